@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "bench.h"
+
+/* set BENCH_SECONDS to change how long each benchmark runs */
+#define BENCH_SECONDS 1.0
+
+static unsigned long alloc_count;
+
+#ifdef __GLIBC__
+/* count allocations by standing in front of the C library's allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+/* CPU time, so other load on the machine disturbs the numbers less */
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_start(struct bench *b, const char *name)
+{
+	memset(b, 0, sizeof(*b));
+	b->name = name;
+	b->start = bench_now();
+	b->allocs = alloc_count;
+}
+
+int bench_more(struct bench *b)
+{
+	static double limit;
+
+	if (!limit) {
+		const char *s = getenv("BENCH_SECONDS");
+
+		limit = s ? atof(s) : 0;
+		if (limit <= 0)
+			limit = BENCH_SECONDS;
+	}
+	return !b->ops || bench_now() - b->start < limit;
+}
+
+void bench_add(struct bench *b, unsigned long long ops,
+	unsigned long long bytes)
+{
+	b->ops += ops;
+	b->bytes += bytes;
+}
+
+/* one line per benchmark, as name followed by key=value fields */
+void bench_report(struct bench *b)
+{
+	double secs = bench_now() - b->start;
+	unsigned long allocs = alloc_count - b->allocs;
+
+	if (!b->ops)
+		b->ops = 1;
+	printf("%s ns_per_op=%.1f mb_per_s=%.1f allocs_per_op=%.3f ops=%llu\n",
+		b->name, secs * 1e9 / b->ops,
+		secs > 0 ? b->bytes / secs / 1e6 : 0.0,
+		(double)allocs / b->ops, b->ops);
+	fflush(stdout);
+}
+
+/* read a whole file into memory. */
+char *bench_load(const char *filename, size_t *len)
+{
+	FILE *f;
+	char *buf = NULL;
+	size_t max = 0, cur = 0;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "%s:%s\n", filename, strerror(errno));
+		return NULL;
+	}
+	while (1) {
+		size_t res;
+
+		if (cur == max) {
+			char *p = realloc(buf, max ? max * 2 : 65536);
+
+			if (!p) {
+				free(buf);
+				fclose(f);
+				return NULL;
+			}
+			buf = p;
+			max = max ? max * 2 : 65536;
+		}
+		res = fread(buf + cur, 1, max - cur, f);
+		if (!res)
+			break;
+		cur += res;
+	}
+	fclose(f);
+	*len = cur;
+	return buf;
+}
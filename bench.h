@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+#include <stddef.h>
+
+/* run a pass until enough time has gone by:
+ *
+ *	for (bench_start(&b, "name"); bench_more(&b); )
+ *		bench_add(&b, ops, bytes);
+ *	bench_report(&b);
+ */
+struct bench {
+	const char *name;
+	double start;
+	unsigned long long ops, bytes;
+	unsigned long allocs;
+};
+
+void bench_start(struct bench *b, const char *name);
+int bench_more(struct bench *b);
+void bench_add(struct bench *b, unsigned long long ops,
+	unsigned long long bytes);
+void bench_report(struct bench *b);
+char *bench_load(const char *filename, size_t *len);
+#endif
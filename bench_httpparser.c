@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "env.h"
+#include "httpparser.h"
+
+#define MAX_HEADERS 4096
+#define MAX_REQUESTS 1024
+
+/* headers of every request in the corpus, for replaying into an env */
+struct header {
+	const char *name, *value;
+	size_t name_len, value_len;
+};
+
+static struct header headers[MAX_HEADERS];
+static unsigned request_end[MAX_REQUESTS]; /* one past its last header */
+static unsigned nr_headers, nr_requests;
+static size_t header_bytes;
+static struct env env;
+
+static void on_method(void *p, const char *method, size_t method_len,
+	const char *uri, size_t uri_len)
+{
+}
+
+static void on_header(void *p, const char *name, size_t name_len,
+	const char *value, size_t value_len)
+{
+}
+
+static void on_method_str(void *p, const char *method, const char *uri)
+{
+}
+
+static void on_header_str(void *p, const char *name, const char *value)
+{
+}
+
+static void on_header_env(void *p, const char *name, size_t name_len,
+	const char *value, size_t value_len)
+{
+	env_setn(&env, name, name_len, value, value_len);
+}
+
+static void on_header_done(void *p)
+{
+	unsigned *count = p;
+
+	(*count)++;
+}
+
+static void on_header_save(void *p, const char *name, size_t name_len,
+	const char *value, size_t value_len)
+{
+	struct header *h;
+
+	if (nr_headers >= MAX_HEADERS)
+		return;
+	h = &headers[nr_headers++];
+	h->name = name;
+	h->name_len = name_len;
+	h->value = value;
+	h->value_len = value_len;
+	header_bytes += name_len + value_len;
+}
+
+static void on_header_done_save(void *p)
+{
+	if (nr_requests < MAX_REQUESTS)
+		request_end[nr_requests++] = nr_headers;
+}
+
+/* keep the headers of each request, as spans into buf. */
+static void load_headers(const char *buf, size_t len)
+{
+	struct httpparser hp;
+	size_t ofs = 0;
+
+	while (ofs < len) {
+		int res;
+
+		httpparser_init(&hp);
+		res = httpparser_span(&hp, buf + ofs, len - ofs, NULL, NULL,
+			on_header_save, on_header_done_save, NULL);
+		if (res <= 0)
+			break;
+		ofs += res;
+	}
+	httpparser_free(&hp);
+}
+
+/* parse every request in buf, fed to the parser step bytes at a time.
+ * returns the number of requests, or -1 on a parse error. */
+static int parse_all(const char *buf, size_t len, size_t step, int strings,
+	void (*report_header)(void *p, const char *name, size_t name_len,
+		const char *value, size_t value_len))
+{
+	struct httpparser hp;
+	unsigned count = 0;
+	size_t ofs = 0;
+
+	httpparser_init(&hp);
+	while (ofs < len) {
+		size_t n = len - ofs < step ? len - ofs : step;
+		int res;
+
+		if (strings)
+			res = httpparser(&hp, buf + ofs, n, &count,
+				on_method_str, on_header_str, on_header_done,
+				NULL);
+		else
+			res = httpparser_span(&hp, buf + ofs, n, &count,
+				on_method, report_header, on_header_done,
+				NULL);
+		if (res < 0) {
+			httpparser_free(&hp);
+			return -1;
+		}
+		ofs += res;
+		if (hp.done) {
+			env_init(&env);
+			httpparser_init(&hp);
+		}
+	}
+	httpparser_free(&hp);
+	return count;
+}
+
+static int bench_parse(const char *name, const char *buf, size_t len,
+	size_t step, int strings,
+	void (*report_header)(void *p, const char *name, size_t name_len,
+		const char *value, size_t value_len))
+{
+	struct bench b;
+	int count;
+
+	for (bench_start(&b, name); bench_more(&b); ) {
+		count = parse_all(buf, len, step, strings, report_header);
+		if (count < 0) {
+			fprintf(stderr, "%s:parse error in corpus\n", name);
+			return -1;
+		}
+		bench_add(&b, count, len);
+	}
+	bench_report(&b);
+	return 0;
+}
+
+/* fill an env with each request's headers, then do the lookups the server
+ * and a typical module would. */
+static void bench_env(void)
+{
+	struct bench b;
+	volatile const char *sink;
+	unsigned i;
+
+	for (bench_start(&b, "env"); bench_more(&b); ) {
+		unsigned r;
+
+		for (r = 0, i = 0; r < nr_requests; r++) {
+			env_init(&env);
+			for (; i < request_end[r]; i++) {
+				const struct header *h = &headers[i];
+
+				env_setn(&env, h->name, h->name_len, h->value,
+					h->value_len);
+			}
+			sink = env_get_known(&env, ENV_HOST);
+			sink = env_get_known(&env, ENV_CONNECTION);
+			sink = env_get(&env, "user-agent");
+			sink = env_get(&env, "If-None-Match");
+		}
+		bench_add(&b, nr_requests, header_bytes);
+	}
+	(void)sink;
+	bench_report(&b);
+}
+
+int main(int argc, char **argv)
+{
+	const char *filename = argc > 1 ? argv[1] : "bench_corpus.http";
+	size_t len;
+	char *buf;
+
+	buf = bench_load(filename, &len);
+	if (!buf)
+		return 1;
+	load_headers(buf, len);
+	if (!nr_requests) {
+		fprintf(stderr, "%s:no requests in corpus\n", filename);
+		return 1;
+	}
+
+	if (bench_parse("httpparser_span", buf, len, len, 0, on_header) ||
+		bench_parse("httpparser_span_split64", buf, len, 64, 0,
+			on_header) ||
+		bench_parse("httpparser", buf, len, len, 1, NULL) ||
+		bench_parse("httpparser_env", buf, len, len, 0, on_header_env))
+		return 1;
+	bench_env();
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include "bench.h"
+#include "httpparser.h"
+#include "module.h"
+#include "service.h"
+#include "util.h"
+
+#define MAX_REQUESTS 1024
+#define NR_ROUTES 3000
+
+struct request {
+	char host[256];
+	char uri[512];
+};
+
+static const struct module bench_module = { .desc = __FILE__ };
+static struct request requests[MAX_REQUESTS];
+static unsigned nr_requests;
+static size_t uri_bytes;
+
+static void on_method(void *p, const char *method, size_t method_len,
+	const char *uri, size_t uri_len)
+{
+	struct request *r = &requests[nr_requests];
+
+	if (uri_len >= sizeof(r->uri))
+		uri_len = sizeof(r->uri) - 1;
+	memcpy(r->uri, uri, uri_len);
+	r->uri[uri_len] = 0;
+	uri_bytes += uri_len;
+}
+
+static void on_header(void *p, const char *name, size_t name_len,
+	const char *value, size_t value_len)
+{
+	struct request *r = &requests[nr_requests];
+
+	if (name_len != 4 || strncasecmp(name, "Host", 4))
+		return;
+	if (value_len >= sizeof(r->host))
+		value_len = sizeof(r->host) - 1;
+	memcpy(r->host, value, value_len);
+	r->host[value_len] = 0;
+}
+
+static void on_header_done(void *p)
+{
+	if (nr_requests < MAX_REQUESTS - 1)
+		nr_requests++;
+}
+
+static void load_requests(const char *buf, size_t len)
+{
+	struct httpparser hp;
+	size_t ofs = 0;
+
+	while (ofs < len) {
+		int res;
+
+		httpparser_init(&hp);
+		res = httpparser_span(&hp, buf + ofs, len - ofs, NULL,
+			on_method, on_header, on_header_done, NULL);
+		if (res <= 0)
+			break;
+		ofs += res;
+	}
+	httpparser_free(&hp);
+}
+
+/* a large site: a catch-all, many applications under their own prefix,
+ * versioned APIs on a wildcard host and lots of literal pages. */
+static int register_routes(void)
+{
+	char uri[64];
+	unsigned i;
+
+	if (service_register("*", "/*", &bench_module, "default"))
+		return -1;
+	for (i = 0; i < NR_ROUTES; i++) {
+		const char *host;
+
+		switch (i % 3) {
+		case 0:
+			host = "www.example.com";
+			snprintf(uri, sizeof(uri), "/app%u/*", i);
+			break;
+		case 1:
+			host = "*.example.com";
+			snprintf(uri, sizeof(uri), "/api/v%u/*", i);
+			break;
+		default:
+			host = "www.example.com";
+			snprintf(uri, sizeof(uri), "/pages/%u.html", i);
+			break;
+		}
+		if (service_register(host, uri, &bench_module, NULL))
+			return -1;
+	}
+	return 0;
+}
+
+static void bench_service_find(void)
+{
+	struct bench b;
+	volatile const struct service *sink;
+	unsigned i;
+
+	for (bench_start(&b, "service_find"); bench_more(&b); ) {
+		for (i = 0; i < nr_requests; i++)
+			sink = service_find(requests[i].host, requests[i].uri);
+		bench_add(&b, nr_requests, uri_bytes);
+	}
+	(void)sink;
+	bench_report(&b);
+}
+
+static void bench_fixpath(void)
+{
+	struct bench b;
+	char path[PATH_MAX];
+	unsigned i;
+
+	for (bench_start(&b, "util_fixpath"); bench_more(&b); ) {
+		for (i = 0; i < nr_requests; i++)
+			util_fixpath(path, sizeof(path), requests[i].uri);
+		bench_add(&b, nr_requests, uri_bytes);
+	}
+	bench_report(&b);
+}
+
+int main(int argc, char **argv)
+{
+	const char *filename = argc > 1 ? argv[1] : "bench_corpus.http";
+	size_t len;
+	char *buf;
+
+	buf = bench_load(filename, &len);
+	if (!buf)
+		return 1;
+	load_requests(buf, len);
+	free(buf);
+	if (!nr_requests) {
+		fprintf(stderr, "%s:no requests in corpus\n", filename);
+		return 1;
+	}
+	if (register_routes()) {
+		fprintf(stderr, "%s:could not register routes\n", __FILE__);
+		return 1;
+	}
+
+	bench_service_find();
+	bench_fixpath();
+	return 0;
+}
@@ -20,7 +20,7 @@
 
 void buffer_reset(struct buffer *bu)
 {
-	bu->cur = 0;
+	bu->head = bu->tail = 0;
 	bu->data[0] = 0;
 }
 
@@ -34,18 +34,45 @@ void buffer_init(struct buffer *bu, char *data, size_t max)
 
 void buffer_consume(struct buffer *bu, unsigned count)
 {
-	assert(count <= bu->cur);
-	if (count <= bu->cur)
-		memmove(bu->data, bu->data + count, bu->cur - count);
-	bu->cur -= count;
+	assert(count <= buffer_len(bu));
+	if (count > buffer_len(bu))
+		count = buffer_len(bu);
+	bu->head += count;
+	if (bu->head == bu->tail)
+		buffer_reset(bu);
+}
+
+/* make room for count bytes plus the terminator after tail, moving the
+ * contents to the front only if that is what it takes. */
+int buffer_reserve(struct buffer *bu, unsigned count)
+{
+	unsigned len = buffer_len(bu);
+
+	if (bu->tail + count < bu->max)
+		return 0;
+	if (len + count >= bu->max)
+		return -1;
+	memmove(bu->data, bu->data + bu->head, len + 1);
+	bu->head = 0;
+	bu->tail = len;
+	return 0;
 }
 
 int buffer_addch(struct buffer *bu, char ch)
 {
-	if (bu->cur + 1 >= bu->max)
+	if (buffer_reserve(bu, 1))
 		return -1;
-	bu->data[bu->cur++] = ch;
-	bu->data[bu->cur] = 0;
+	bu->data[bu->tail++] = ch;
+	bu->data[bu->tail] = 0;
 	return 0;
 }
 
+int buffer_append(struct buffer *bu, const void *data, unsigned len)
+{
+	if (buffer_reserve(bu, len))
+		return -1;
+	memcpy(bu->data + bu->tail, data, len);
+	bu->tail += len;
+	bu->data[bu->tail] = 0;
+	return 0;
+}
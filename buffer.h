@@ -15,12 +15,33 @@
  */
 #ifndef BUFFER_H
 #define BUFFER_H
+#include <stddef.h>
+
+/* the contents are data[head..tail), and are kept terminated. consuming
+ * moves head, the contents are only moved to the front when the free
+ * space after tail is too small for what is being added. */
 struct buffer {
-	unsigned cur, max;
+	unsigned head, tail, max;
 	char *data;
 };
 
 /* initialize a buffer with a fixed array. */
-#define buffer_wrap(str) { 0, sizeof(str), (str) }
+#define buffer_wrap(str) { 0, 0, sizeof(str), (str) }
+
+static inline char *buffer_data(const struct buffer *bu)
+{
+	return bu->data + bu->head;
+}
+
+static inline unsigned buffer_len(const struct buffer *bu)
+{
+	return bu->tail - bu->head;
+}
 
+void buffer_reset(struct buffer *bu);
+void buffer_init(struct buffer *bu, char *data, size_t max);
+void buffer_consume(struct buffer *bu, unsigned count);
+int buffer_reserve(struct buffer *bu, unsigned count);
+int buffer_addch(struct buffer *bu, char ch);
+int buffer_append(struct buffer *bu, const void *data, unsigned len);
 #endif
@@ -18,36 +18,57 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "logger.h"
 #include "httpparser.h"
 #include "channel.h"
 
-static size_t buf_check(size_t *buf_max, size_t buf_cur, size_t count)
-{
-	size_t max = *buf_max;
-
-	// TODO: we could grow the buf
-	assert(buf_cur <= max);
-	return (buf_cur + count < max) ? count : max - buf_cur;
-}
+/* a piece of output held back on a non-blocking channel. a file range has
+ * its own descriptor, the one it came from may be closed before it is sent.
+ * for bytes, offset is how much of data has gone out. */
+struct ch_backlog {
+	struct ch_backlog *next;
+	int fd; /* -1 for bytes in data */
+	int copy; /* sendfile() refused the file, read it a piece at a time */
+	off_t offset;
+	size_t len; /* what is left to send */
+	char data[];
+};
 
-static void buf_commit(size_t buf_max, size_t *buf_cur, size_t count)
+/* the buffers are not cleared, a channel may be reused for every request */
+void ch_init(struct channel *ch, struct net_socket sock, const char *desc)
 {
-	assert((*buf_cur) + count <= buf_max);
-	(*buf_cur) += count;
+	ch->sock = sock;
+	ch->in = NULL;
+	ch->in_size = 0;
+	ch->in_head = ch->in_tail = 0;
+	ch->in_want = CHANNEL_READ_MIN;
+	ch->out_cur = 0;
+	ch->done = 0;
+	ch->error = 0;
+	ch->nonblock = 0;
+	ch->backlog = NULL;
+	ch->backlog_tail = &ch->backlog;
+	ch->desc[0] = 0;
+	if (desc)
+		snprintf(ch->desc, sizeof(ch->desc), "%s", desc);
 }
 
-void ch_init(struct channel *ch, struct net_socket sock, const char *desc)
+/* the peer address is only formatted for connections that log something */
+const char *ch_desc(struct channel *ch)
 {
-	memset(ch, 0, sizeof(*ch));
-	ch->buf_max = sizeof(ch->buf);
-	ch->done = 0;
-	ch->sock = sock;
-	ch->desc = desc ? strdup(desc) : NULL;
+	if (!ch->desc[0])
+		net_socket_name(&ch->sock, ch->desc, sizeof(ch->desc));
+	return ch->desc;
 }
 
-static ch_is_connected(struct channel *ch)
+static int ch_is_connected(struct channel *ch)
 {
 	return ch->sock.fd != -1;
 }
@@ -57,87 +78,504 @@ void ch_done(struct channel *ch)
 	ch->done = 1;
 }
 
+static void ch_backlog_free(struct channel *ch)
+{
+	struct ch_backlog *b;
+
+	while ((b = ch->backlog)) {
+		ch->backlog = b->next;
+		if (b->fd >= 0)
+			close(b->fd);
+		free(b);
+	}
+	ch->backlog_tail = &ch->backlog;
+}
+
+/* queue bytes from iov, or count bytes of fd when iov is NULL */
+static int ch_backlog_add(struct channel *ch, const struct iovec *iov,
+	int iovcnt, int fd, off_t offset, size_t count)
+{
+	struct ch_backlog *b;
+	int i;
+
+	if (iov) {
+		for (count = 0, i = 0; i < iovcnt; i++)
+			count += iov[i].iov_len;
+	}
+	if (!count)
+		return 0;
+	b = malloc(sizeof(*b) + (iov ? count : 0));
+	if (!b)
+		goto failure;
+	b->next = NULL;
+	b->copy = 0;
+	b->len = count;
+	if (iov) {
+		b->fd = -1;
+		b->offset = 0;
+		for (count = 0, i = 0; i < iovcnt; i++) {
+			memcpy(b->data + count, iov[i].iov_base,
+				iov[i].iov_len);
+			count += iov[i].iov_len;
+		}
+	} else {
+		b->offset = offset;
+		b->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (b->fd < 0) {
+			free(b);
+			goto failure;
+		}
+	}
+	*ch->backlog_tail = b;
+	ch->backlog_tail = &b->next;
+	return 0;
+failure:
+	perror(ch_desc(ch));
+	ch->error = 1;
+	ch_done(ch);
+	return -1;
+}
+
+int ch_backlogged(const struct channel *ch)
+{
+	return ch->backlog != NULL;
+}
+
+/* read a piece of a file that sendfile() refused and send what the socket
+ * takes of it. no more than one piece is in memory at a time. */
+static ssize_t ch_copy_piece(struct channel *ch, struct ch_backlog *b,
+	int flags)
+{
+	char buf[sizeof(ch->out)];
+	ssize_t res;
+
+	res = pread(b->fd, buf, b->len < sizeof(buf) ? b->len : sizeof(buf),
+		b->offset);
+	if (res <= 0)
+		return res;
+	if ((size_t)res < b->len)
+		flags |= MSG_MORE;
+	res = send(ch->sock.fd, buf, res, flags);
+	if (res > 0)
+		b->offset += res;
+	return res;
+}
+
+/* send output that was held back, called when the socket is writable.
+ * returns 1 while some is left, 0 once all of it went out, or -1 if the
+ * connection failed. */
+int ch_drain(struct channel *ch)
+{
+	struct ch_backlog *b;
+
+	while ((b = ch->backlog)) {
+		int more = b->next ? MSG_MORE : 0;
+		ssize_t res;
+
+		if (b->fd < 0)
+			res = send(ch->sock.fd, b->data + b->offset, b->len,
+				more);
+		else if (!b->copy)
+			res = sendfile(ch->sock.fd, b->fd, &b->offset,
+				b->len);
+		else
+			res = ch_copy_piece(ch, b, more);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0 && b->fd >= 0 && !b->copy &&
+			(errno == EINVAL || errno == ENOSYS)) {
+			/* this kind of file can't be sent directly */
+			b->copy = 1;
+			continue;
+		}
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+		if (res <= 0) {
+			if (res)
+				perror(ch_desc(ch));
+			else
+				Error("%s:file is shorter than expected\n",
+					ch_desc(ch));
+			ch->error = 1;
+			ch_done(ch);
+			ch_backlog_free(ch);
+			return -1;
+		}
+		if (b->fd < 0)
+			b->offset += res;
+		b->len -= res;
+		if (b->len)
+			continue;
+		ch->backlog = b->next;
+		if (!ch->backlog)
+			ch->backlog_tail = &ch->backlog;
+		if (b->fd >= 0)
+			close(b->fd);
+		free(b);
+	}
+	return 0;
+}
+
 void ch_close(struct channel *ch)
 {
 	if (!ch)
 		return;
-	if (ch->sock.fd != -1)
+	if (ch->sock.fd != -1) {
+		ch_flush(ch);
 		if (close(ch->sock.fd))
-			perror(ch->desc);
+			perror(ch_desc(ch));
+	}
 	ch->sock.fd = -1;
-	free(ch->desc);
-	ch->desc = NULL;
+	ch_backlog_free(ch);
+	ch_release(ch);
+}
+
+/* give back the input ring, anything not yet consumed is dropped */
+void ch_release(struct channel *ch)
+{
+	free(ch->in);
+	ch->in = NULL;
+	ch->in_size = 0;
+	ch->in_head = ch->in_tail = 0;
+}
+
+/* make room for want bytes. the only time input is copied, and then at
+ * most once per doubling. */
+static int ch_reserve(struct channel *ch, size_t want)
+{
+	size_t used = ch->in_tail - ch->in_head;
+	size_t size = ch->in_size ? ch->in_size : CHANNEL_READ_MIN;
+	size_t ofs, n;
+	char *in;
+
+	while (size < used + want)
+		size *= 2;
+	if (size == ch->in_size)
+		return 0;
+	in = malloc(size);
+	if (!in) {
+		perror(ch_desc(ch));
+		return -1;
+	}
+	/* unwrap what is left to the start of the new ring */
+	if (used) {
+		ofs = ch->in_head & (ch->in_size - 1);
+		n = used < ch->in_size - ofs ? used : ch->in_size - ofs;
+		memcpy(in, ch->in + ofs, n);
+		memcpy(in + n, ch->in, used - n);
+	}
+	free(ch->in);
+	ch->in = in;
+	ch->in_size = size;
+	ch->in_head = 0;
+	ch->in_tail = used;
+	return 0;
 }
 
+/* a read fills the free part of the ring, wrapping with readv(). when it
+ * comes back full the next one asks for twice as much, up to
+ * CHANNEL_READ_MAX, so bulk uploads take few system calls while small
+ * requests stay in a small ring. */
 int ch_fill(struct channel *ch)
 {
+	struct iovec iov[2];
 	ssize_t res;
-	size_t count;
+	size_t ofs, count;
 
-	count = buf_check(&ch->buf_max, ch->buf_cur, CHANNEL_CHUNK_SIZE);
-	assert(count != 0);
-	res = read(ch->sock.fd, ch->buf + ch->buf_cur, count);
+	if (ch_reserve(ch, ch->in_want))
+		return -1;
+	ofs = ch->in_tail & (ch->in_size - 1);
+	count = ch->in_size - (ch->in_tail - ch->in_head);
+	iov[0].iov_base = ch->in + ofs;
+	iov[0].iov_len = count < ch->in_size - ofs ? count : ch->in_size - ofs;
+	iov[1].iov_base = ch->in;
+	iov[1].iov_len = count - iov[0].iov_len;
+	if (iov[1].iov_len)
+		res = readv(ch->sock.fd, iov, 2);
+	else
+		res = read(ch->sock.fd, iov[0].iov_base, count);
 	Debug("%s:read %zd bytes (asked for %zd bytes)\n",
-		ch->desc, res, count);
-	Debug("%s:cur=%zd max=%zd\n", ch->desc, ch->buf_cur, ch->buf_max);
+		ch_desc(ch), res, count);
 	if (res <= 0) {
+		/* non-blocking socket has nothing for us yet, or a signal
+		 * interrupted the wait. errno tells the two apart. */
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR))
+			return 0;
 		if (res < 0)
-			perror(ch->desc);
+			perror(ch_desc(ch));
 		return -1;
 	}
-	buf_commit(ch->buf_max, &ch->buf_cur, res);
+	ch->in_tail += res;
+	if ((size_t)res == count && ch->in_want < CHANNEL_READ_MAX)
+		ch->in_want *= 2;
 	return 1;
+}
+
+/* the oldest input not yet consumed, NULL if there is none. *len is what
+ * is contiguous, the rest follows from the start of the ring. */
+const char *ch_peek(struct channel *ch, size_t *len)
+{
+	size_t ofs, used = ch->in_tail - ch->in_head;
 
+	if (!used)
+		return NULL;
+	ofs = ch->in_head & (ch->in_size - 1);
+	*len = used < ch->in_size - ofs ? used : ch->in_size - ofs;
+	return ch->in + ofs;
 }
 
-int ch_write(struct channel *ch, const void *buf, size_t count)
+void ch_consume(struct channel *ch, size_t len)
 {
-	while (count > 0) {
+	assert(len <= ch->in_tail - ch->in_head);
+	ch->in_head += len;
+	/* start over at the front, the next read is less likely to wrap */
+	if (ch->in_head == ch->in_tail)
+		ch->in_head = ch->in_tail = 0;
+}
+
+size_t ch_pending(struct channel *ch)
+{
+	return ch->in_tail - ch->in_head;
+}
+
+/* block until a non-blocking socket can take more data. */
+static int ch_wait_writable(struct channel *ch)
+{
+	struct pollfd pfd = { .fd = ch->sock.fd, .events = POLLOUT };
+	int res;
+
+	do {
+		res = poll(&pfd, 1, CHANNEL_WRITE_TIMEOUT);
+	} while (res < 0 && errno == EINTR);
+	if (res <= 0) {
+		Error("%s:write timed out\n", ch_desc(ch));
+		return -1;
+	}
+	return 0;
+}
+
+/* write every iovec, waiting on a non-blocking socket if needed, or
+ * queueing what is left for a nonblock channel. flags are for sendmsg(),
+ * MSG_MORE holds a partial packet for what follows. */
+static int ch_sendv(struct channel *ch, struct iovec *iov, int iovcnt,
+	int flags)
+{
+	if (ch->backlog)
+		return ch_backlog_add(ch, iov, iovcnt, -1, 0, 0);
+	while (iovcnt > 0) {
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
 		ssize_t res;
 
-		if (ch->done)
+		if (ch->error)
 			return -1;
-		res = write(ch->sock.fd, buf, count);
+		if (flags)
+			res = sendmsg(ch->sock.fd, &msg, flags);
+		else
+			res = writev(ch->sock.fd, iov, iovcnt);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (ch->nonblock)
+				return ch_backlog_add(ch, iov, iovcnt, -1,
+					0, 0);
+			if (!ch_wait_writable(ch))
+				continue;
+			res = -1;
+		} else if (res < 0) {
+			perror(ch_desc(ch));
+		}
 		if (res < 0) {
-			perror(ch->desc);
+			ch->error = 1;
 			ch_done(ch);
-			return res;
+			return -1;
+		}
+		/* skip what was written, resume at a partial iovec */
+		while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+
+	return 0;
+}
+
+static int ch_flush_flags(struct channel *ch, int flags)
+{
+	struct iovec iov;
+
+	if (!ch->out_cur)
+		return 0;
+	iov.iov_base = ch->out;
+	iov.iov_len = ch->out_cur;
+	ch->out_cur = 0;
+	return ch_sendv(ch, &iov, 1, flags);
+}
+
+/* send anything that was buffered by ch_write(). */
+int ch_flush(struct channel *ch)
+{
+	return ch_flush_flags(ch, 0);
+}
+
+/* append several pieces to the output buffer. anything that does not fit
+ * goes out together with the buffered data in a single writev(). */
+int ch_writev(struct channel *ch, const struct iovec *iov, int iovcnt)
+{
+	struct iovec out[CHANNEL_IOV_MAX + 1];
+	size_t total = 0;
+	int i;
+
+	if (ch->done)
+		return -1;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (total <= sizeof(ch->out) - ch->out_cur) {
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(ch->out + ch->out_cur, iov[i].iov_base,
+				iov[i].iov_len);
+			ch->out_cur += iov[i].iov_len;
+		}
+		return 0;
+	}
+	assert(iovcnt <= CHANNEL_IOV_MAX);
+	out[0].iov_base = ch->out;
+	out[0].iov_len = ch->out_cur;
+	memcpy(out + 1, iov, iovcnt * sizeof(*iov));
+	ch->out_cur = 0;
+	return ch_sendv(ch, out, iovcnt + 1, 0);
+}
+
+/* copy a file through the output buffer, for when sendfile() can't. */
+static int ch_copyfile(struct channel *ch, int fd, off_t offset, size_t count)
+{
+	while (count > 0) {
+		size_t avail = sizeof(ch->out) - ch->out_cur;
+		ssize_t res;
+
+		if (!avail) {
+			/* the rest of the file follows */
+			if (ch_flush_flags(ch, MSG_MORE))
+				return -1;
+			continue;
+		}
+		res = pread(fd, ch->out + ch->out_cur,
+			count < avail ? count : avail, offset);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			Error("%s:file read failed:%s\n", ch_desc(ch),
+				res ? strerror(errno) : "short file");
+			return -1;
 		}
+		ch->out_cur += res;
+		offset += res;
 		count -= res;
-		buf += res;
 	}
+	return 0;
+}
+
+/* send count bytes of a file without copying them through userspace. the
+ * buffered headers are sent with MSG_MORE so they share a packet with the
+ * start of the file, the end of the sendfile() pushes them both out. */
+int ch_sendfile(struct channel *ch, int fd, off_t offset, size_t count)
+{
+	int first = 1;
 
+	if (ch->done)
+		return -1;
+	if (ch_flush_flags(ch, count ? MSG_MORE : 0))
+		return -1;
+	if (ch->backlog)
+		return ch_backlog_add(ch, NULL, 0, fd, offset, count);
+	while (count > 0) {
+		ssize_t res;
+
+		res = sendfile(ch->sock.fd, fd, &offset, count);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (ch->nonblock)
+				return ch_backlog_add(ch, NULL, 0, fd,
+					offset, count);
+			if (!ch_wait_writable(ch))
+				continue;
+		} else if (res < 0 && first &&
+			(errno == EINVAL || errno == ENOSYS)) {
+			/* this kind of file or socket can't do it. rather
+			 * than copy all of it now, a nonblock channel queues
+			 * the range for ch_drain() to copy piece by piece */
+			if (!ch->nonblock)
+				return ch_copyfile(ch, fd, offset, count);
+			if (ch_backlog_add(ch, NULL, 0, fd, offset, count))
+				return -1;
+			return ch_drain(ch) < 0 ? -1 : 0;
+		} else if (res == 0) {
+			Error("%s:file is shorter than expected\n",
+				ch_desc(ch));
+		} else if (res < 0) {
+			perror(ch_desc(ch));
+		}
+		if (res <= 0) {
+			ch->error = 1;
+			ch_done(ch);
+			return -1;
+		}
+		first = 0;
+		count -= res;
+	}
 	return 0;
 }
 
+int ch_write(struct channel *ch, const void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = (void*)buf, .iov_len = count };
+
+	return ch_writev(ch, &iov, 1);
+}
+
+/* format directly into the output buffer. */
 int ch_printf(struct channel *ch, const char *fmt, ...)
 {
 	va_list ap;
 	int res;
+	size_t avail;
+	char *tmp;
 
-	if (!ch_is_connected(ch))
+	if (!ch_is_connected(ch) || ch->done)
 		return -1;
+	avail = sizeof(ch->out) - ch->out_cur;
 	va_start(ap, fmt);
-	res = vdprintf(ch->sock.fd, fmt, ap);
+	res = vsnprintf(ch->out + ch->out_cur, avail, fmt, ap);
 	va_end(ap);
+	if (res < 0)
+		return -1;
+	if ((size_t)res < avail) {
+		ch->out_cur += res;
+		return res;
+	}
+	/* too big for what is left, format it on the side */
+	va_start(ap, fmt);
+	res = vasprintf(&tmp, fmt, ap);
+	va_end(ap);
+	if (res < 0)
+		return -1;
+	if (ch_write(ch, tmp, res))
+		res = -1;
+	free(tmp);
 	return res;
 }
 
 int ch_puts(struct channel *ch, const char *str)
 {
-	size_t cur = 0, len = strlen(str);
-	ssize_t res;
+	size_t len = strlen(str);
 
-	if (!ch_is_connected(ch))
+	if (!ch_is_connected(ch) || ch_write(ch, str, len))
 		return -1;
-	do {
-		res = send(ch->sock.fd, str + cur, len - cur, 0);
-		if (res < 0) {
-			SysError();
-			break;
-		}
-		assert(res != 0);
-		cur += res;
-	} while(cur < len);
 	return len;
 }
@@ -16,24 +16,52 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 #include <stddef.h>
+#include <sys/types.h>
 #include "net.h"
 
 #define CHANNEL_CHUNK_SIZE 256
+#define CHANNEL_WRITE_TIMEOUT 30000 /* milliseconds */
+#define CHANNEL_IOV_MAX 8 /* pieces accepted by one ch_writev() */
+#define CHANNEL_READ_MIN 512 /* input ring of a new connection */
+#define CHANNEL_READ_MAX 65536 /* the ring stops growing for bulk reads */
+
+struct iovec;
+struct ch_backlog;
 
 struct channel {
 	struct net_socket sock;
-	char *desc;
-	size_t buf_max;
-	size_t buf_cur;
+	char desc[NET_NAME_MAX]; /* empty until ch_desc() */
+	/* input ring, allocated by the first read. head and tail count
+	 * every byte ever read and consumed, masked on access. */
+	char *in;
+	size_t in_size; /* a power of two */
+	size_t in_head, in_tail;
+	size_t in_want; /* size for the next read, doubles when one fills */
 	int done;
-	char buf[CHANNEL_CHUNK_SIZE * 16];
+	int error; /* output failed, the connection is unusable */
+	size_t out_cur;
+	char out[CHANNEL_CHUNK_SIZE * 16]; /* pending output */
+	/* with nonblock set, output the socket won't take is queued here
+	 * instead of waiting, and ch_drain() sends it once writable */
+	int nonblock;
+	struct ch_backlog *backlog, **backlog_tail;
 };
 
 void ch_init(struct channel *ch, struct net_socket sock, const char *desc);
+const char *ch_desc(struct channel *ch);
 void ch_done(struct channel *ch);
 void ch_close(struct channel *ch);
+void ch_release(struct channel *ch);
 int ch_fill(struct channel *ch);
+const char *ch_peek(struct channel *ch, size_t *len);
+void ch_consume(struct channel *ch, size_t len);
+size_t ch_pending(struct channel *ch);
 int ch_write(struct channel *ch, const void *buf, size_t count);
+int ch_writev(struct channel *ch, const struct iovec *iov, int iovcnt);
+int ch_flush(struct channel *ch);
+int ch_sendfile(struct channel *ch, int fd, off_t offset, size_t count);
+int ch_drain(struct channel *ch);
+int ch_backlogged(const struct channel *ch);
 int ch_printf(struct channel *ch, const char *fmt, ...);
 int ch_puts(struct channel *ch, const char *str);
 #endif
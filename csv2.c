@@ -25,8 +25,8 @@
 static void _csv_next_field(struct csv_parser *cp)
 {
 	if (cp->field) {
-		if (cp->field(cp->p, cp->row, cp->col, cp->buf.cur,
-			cp->buf.data)) {
+		if (cp->field(cp->p, cp->row, cp->col, buffer_len(&cp->buf),
+			buffer_data(&cp->buf))) {
 			cp->s = CSV_ERROR;
 			return;
 		}
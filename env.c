@@ -15,118 +15,258 @@
  */
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
 #include "env.h"
 
+/* each entry is a flag byte, then the name and value strings */
+#define ENTRY_LIVE 1
+#define ENTRY_DEAD 2
+
+#define INDEX_MASK (ENV_INDEX_SIZE - 1)
+#define INDEX_LIMIT (ENV_INDEX_SIZE * 3 / 4)
+
+static const struct {
+	const char *name;
+	size_t len;
+} known_names[ENV_KNOWN_MAX] = {
+	[ENV_HOST] = { "Host", 4 },
+	[ENV_CONNECTION] = { "Connection", 10 },
+	[ENV_CONTENT_LENGTH] = { "Content-Length", 14 },
+	[ENV_CONTENT_TYPE] = { "Content-Type", 12 },
+	[ENV_TRANSFER_ENCODING] = { "Transfer-Encoding", 17 },
+	[ENV_EXPECT] = { "Expect", 6 },
+};
+
+static int known_id(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < ENV_KNOWN_MAX; i++) {
+		if (known_names[i].len == len &&
+			!strncasecmp(known_names[i].name, name, len))
+			return i;
+	}
+	return -1;
+}
+
+/* FNV-1a over the name folded to lower case */
+static unsigned hash_name(const char *name, size_t len)
+{
+	unsigned h = 2166136261u;
+
+	while (len--) {
+		unsigned char c = *name++;
+
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		h ^= c;
+		h *= 16777619u;
+	}
+	return h;
+}
+
 static int env_load(struct env *env, unsigned ofs, char **name,
-	size_t *name_len, char **val, size_t *val_len, unsigned *next)
+	char **val, unsigned *next)
 {
 	char *heap = env->heap;
 	unsigned name_start, val_start;
 	unsigned _name_len, _val_len;
 
-	// TODO: skip over leading \0 characters.
-
-	name_start = ofs;
+	name_start = ofs + 1;
 	assert(name_start < env->cur);
 	if (name_start >= env->cur)
 		return -1;
 	_name_len = strlen(&heap[name_start]) + 1;
 
-	val_start = ofs + _name_len;
+	val_start = name_start + _name_len;
 	if (val_start >= env->cur)
 		return -1;
 	_val_len = strlen(&heap[val_start]) + 1;
 
 	if (name)
 		*name = env->heap + name_start;
-	if (name_len)
-		*name_len = _name_len;
 	if (val)
 		*val = env->heap + val_start;
-	if (val_len)
-		*val_len = _val_len;
 	if (next)
 		*next = val_start + _val_len;
 
 	return 0;
 }
 
-static int env_find(struct env *env, const char *name, unsigned *ofs, unsigned *len)
+/* returns the index slot holding name, or -1. if slot is not NULL it is set
+ * to the slot where name can be added. */
+static int env_find(struct env *env, const char *name, size_t len,
+	unsigned hash, unsigned *slot)
+{
+	unsigned i, n;
+	int free_slot = -1;
+
+	for (i = hash & INDEX_MASK, n = 0; env->index[i] && n < ENV_INDEX_SIZE;
+		i = (i + 1) & INDEX_MASK, n++) {
+		const char *heap = env->heap + env->index[i] - 1;
+
+		if (heap[0] == ENTRY_DEAD) {
+			if (free_slot < 0)
+				free_slot = i;
+			continue;
+		}
+		if (!strncasecmp(heap + 1, name, len) && !heap[1 + len])
+			return i;
+	}
+	if (slot)
+		*slot = free_slot >= 0 ? (unsigned)free_slot : i;
+	return -1;
+}
+
+static void env_unlink(struct env *env, unsigned i)
+{
+	unsigned ofs = env->index[i] - 1;
+	int k;
+
+	env->heap[ofs] = ENTRY_DEAD;
+	for (k = 0; k < ENV_KNOWN_MAX; k++)
+		if (env->known[k] == ofs + 1)
+			env->known[k] = 0;
+}
+
+static void env_link(struct env *env, unsigned slot, unsigned ofs,
+	const char *name, size_t len)
 {
-	unsigned i, next;
+	int k = known_id(name, len);
 
+	if (!env->index[slot])
+		env->used++;
+	env->index[slot] = ofs + 1;
+	if (k >= 0)
+		env->known[k] = ofs + 1;
+}
+
+/* squeeze out deleted entries and rebuild the index. */
+static void env_compact(struct env *env)
+{
+	unsigned i, next, cur = 0;
+
+	memset(env->index, 0, sizeof(env->index));
+	memset(env->known, 0, sizeof(env->known));
+	env->used = 0;
 	for (i = 0; i < env->cur; i = next) {
-		char *cur_name, *cur_val;
-
-		if (env_load(env, i, &cur_name, NULL, &cur_val, NULL, &next))
-			return 0; /* weird/corrupt data in buffer */
-		if (!strcmp(name, cur_name)) {
-			if (ofs)
-				*ofs = i;
-			if (len)
-				*len = next - i; // TODO: check this
-			return 1;
+		char *name;
+		size_t len;
+		unsigned slot;
+		int found;
+
+		if (env_load(env, i, &name, NULL, &next))
+			break; /* weird/corrupt data in buffer */
+		if (env->heap[i] == ENTRY_DEAD)
+			continue;
+		len = strlen(name);
+		memmove(&env->heap[cur], &env->heap[i], next - i);
+		found = env_find(env, env->heap + cur + 1, len,
+			hash_name(env->heap + cur + 1, len), &slot);
+		if (found >= 0) {
+			/* a later entry of the same name wins */
+			env_unlink(env, found);
+			slot = found;
 		}
+		env_link(env, slot, cur, env->heap + cur + 1, len);
+		cur += next - i;
 	}
-	return 0; /* not found */
+	env->cur = cur;
 }
 
 int env_delete(struct env *env, const char *name)
 {
-	unsigned ofs, len;
+	size_t len = strlen(name);
+	int i;
 
-	if (env_find(env, name, &ofs, &len)) {
-		env->cur -= len;
-		memmove(&env->heap[ofs], &env->heap[ofs + len], env->cur);
-		return 0;
-	}
+	i = env_find(env, name, len, hash_name(name, len), NULL);
+	if (i >= 0)
+		env_unlink(env, i);
 	return 0;
 }
 
 const char *env_get(struct env *env, const char *name)
 {
-	unsigned ofs;
+	size_t len = strlen(name);
+	int i;
 	char *val;
 
-	if (env_find(env, name, &ofs, NULL)) {
-		if (!env_load(env, ofs, NULL, NULL, &val, NULL, NULL))
-			return val;
-	}
+	i = env_find(env, name, len, hash_name(name, len), NULL);
+	if (i >= 0 && !env_load(env, env->index[i] - 1, NULL, &val, NULL))
+		return val;
 	return NULL;
 }
 
-int env_set(struct env *env, const char *name, const char *value)
+const char *env_get_known(struct env *env, enum env_known id)
 {
-	size_t name_len = strlen(name) + 1;
-	size_t val_len = strlen(value) + 1;
-	unsigned cur;
+	char *val;
 
-	env_delete(env, name);
+	assert(id < ENV_KNOWN_MAX);
+	if (env->known[id] &&
+		!env_load(env, env->known[id] - 1, NULL, &val, NULL))
+		return val;
+	return NULL;
+}
 
-	cur = env->cur;
-	if (cur + name_len + val_len > env->max)
+/* name and value do not need to be terminated, but may not hold a NUL. */
+int env_setn(struct env *env, const char *name, size_t name_len,
+	const char *value, size_t value_len)
+{
+	size_t need = 1 + name_len + 1 + value_len + 1;
+	unsigned hash = hash_name(name, name_len);
+	unsigned slot, cur;
+	int i;
+
+	if (memchr(name, 0, name_len) || memchr(value, 0, value_len))
 		return -1;
+	i = env_find(env, name, name_len, hash, &slot);
+	if (i >= 0) {
+		env_unlink(env, i);
+		slot = i;
+	}
 
-	memcpy(&env->heap[cur], name, name_len);
-	cur += name_len;
-	memcpy(&env->heap[cur], value, val_len);
-	cur += val_len;
-	env->cur = cur;
+	if (env->cur + need > env->max || env->used >= INDEX_LIMIT) {
+		env_compact(env);
+		if (env->cur + need > env->max || env->used >= INDEX_LIMIT)
+			return -1;
+		env_find(env, name, name_len, hash, &slot);
+	}
+
+	cur = env->cur;
+	env->heap[cur] = ENTRY_LIVE;
+	memcpy(&env->heap[cur + 1], name, name_len);
+	env->heap[cur + 1 + name_len] = 0;
+	memcpy(&env->heap[cur + 2 + name_len], value, value_len);
+	env->heap[cur + 2 + name_len + value_len] = 0;
+	env->cur = cur + need;
+	env_link(env, slot, cur, name, name_len);
 
 	return 0;
 }
 
+int env_set(struct env *env, const char *name, const char *value)
+{
+	return env_setn(env, name, strlen(name), value, strlen(value));
+}
+
 int env_next(struct env *env, struct env_iter *iter,
 	const char **name, const char **value)
 {
 	char *_name, *_val;
 	unsigned next;
 
-	if (iter->i >= env->cur)
-		return 0;
+	do {
+		if (iter->i >= env->cur)
+			return 0;
+
+		if (env_load(env, iter->i, &_name, &_val, &next))
+			return 0; /* weird error - stop */
 
-	if (env_load(env, iter->i, &_name, NULL, &_val, NULL, &next))
-		return 0; /* weird error - stop */
+		if (env->heap[iter->i] == ENTRY_DEAD)
+			iter->i = next;
+		else
+			break;
+	} while (1);
 
 	iter->i = next;
 	if (name)
@@ -135,4 +275,3 @@ int env_next(struct env *env, struct env_iter *iter,
 		*value = _val;
 	return 1;
 }
-
@@ -15,8 +15,29 @@
  */
 #ifndef ENV_H
 #define ENV_H
+#include <stddef.h>
+#include <string.h>
+
+#define ENV_INDEX_SIZE 128 /* must be a power of two */
+
+/* headers the server looks up itself, found without hashing */
+enum env_known {
+	ENV_HOST,
+	ENV_CONNECTION,
+	ENV_CONTENT_LENGTH,
+	ENV_CONTENT_TYPE,
+	ENV_TRANSFER_ENCODING,
+	ENV_EXPECT,
+	ENV_KNOWN_MAX
+};
+
+/* names are matched without regard to case. entries are packed into heap,
+ * and index is an open-addressed table of heap offsets plus one. */
 struct env {
 	unsigned cur, max;
+	unsigned used; /* index slots taken, including deleted entries */
+	unsigned short index[ENV_INDEX_SIZE];
+	unsigned short known[ENV_KNOWN_MAX];
 	char heap[2048 - (2 * sizeof(unsigned))];
 };
 
@@ -28,6 +49,9 @@ static inline void env_init(struct env *env)
 {
 	env->cur = 0;
 	env->max = sizeof(env->heap);
+	env->used = 0;
+	memset(env->index, 0, sizeof(env->index));
+	memset(env->known, 0, sizeof(env->known));
 }
 
 static inline void env_iter(struct env_iter *iter)
@@ -36,7 +60,10 @@ static inline void env_iter(struct env_iter *iter)
 }
 
 const char *env_get(struct env *env, const char *name);
+const char *env_get_known(struct env *env, enum env_known id);
 int env_set(struct env *env, const char *name, const char *value);
+int env_setn(struct env *env, const char *name, size_t name_len,
+	const char *value, size_t value_len);
 int env_delete(struct env *env, const char *name);
 int env_next(struct env *env, struct env_iter *iter,
 	const char **name, const char **value);
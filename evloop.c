@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "logger.h"
+#include "evloop.h"
+
+#define EVLOOP_MAX_EVENTS 64
+
+#ifndef EPOLLEXCLUSIVE
+# define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+struct evloop {
+	int epfd;
+	int done;
+	/* the batch being dispatched, so evloop_del() can drop stale events */
+	struct epoll_event *pending;
+	int pending_next, pending_count;
+};
+
+static unsigned to_epoll(unsigned events)
+{
+	unsigned ev = 0;
+
+	if (events & EVLOOP_READ)
+		ev |= EPOLLIN;
+	if (events & EVLOOP_WRITE)
+		ev |= EPOLLOUT;
+	/* the kernel refuses EPOLLRDHUP on exclusive watches */
+	if (events & EVLOOP_EXCLUSIVE)
+		ev |= EPOLLEXCLUSIVE;
+	else if (events & EVLOOP_READ)
+		ev |= EPOLLRDHUP;
+	return ev;
+}
+
+static unsigned from_epoll(unsigned ev)
+{
+	unsigned events = 0;
+
+	/* errors and hangups are reported as readable, read() will tell */
+	if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		events |= EVLOOP_READ;
+	if (ev & EPOLLOUT)
+		events |= EVLOOP_WRITE;
+	return events;
+}
+
+struct evloop *evloop_new(void)
+{
+	struct evloop *loop;
+
+	loop = calloc(1, sizeof(*loop));
+	if (!loop) {
+		SysError();
+		return NULL;
+	}
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		SysError();
+		free(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+void evloop_free(struct evloop *loop)
+{
+	if (!loop)
+		return;
+	close(loop->epfd);
+	free(loop);
+}
+
+static int evloop_ctl(struct evloop *loop, int op, struct evwatch *w,
+	unsigned events)
+{
+	struct epoll_event ev;
+
+	ev.events = to_epoll(events);
+	ev.data.ptr = w;
+	if (epoll_ctl(loop->epfd, op, w->fd, &ev)) {
+		Error("epoll_ctl(fd=%d):%s\n", w->fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int evloop_add(struct evloop *loop, struct evwatch *w, unsigned events)
+{
+	return evloop_ctl(loop, EPOLL_CTL_ADD, w, events);
+}
+
+int evloop_mod(struct evloop *loop, struct evwatch *w, unsigned events)
+{
+	return evloop_ctl(loop, EPOLL_CTL_MOD, w, events);
+}
+
+/* a callback may remove and free other watches of its own loop */
+int evloop_del(struct evloop *loop, struct evwatch *w)
+{
+	int i;
+
+	for (i = loop->pending_next; i < loop->pending_count; i++)
+		if (loop->pending[i].data.ptr == w)
+			loop->pending[i].data.ptr = NULL;
+	return evloop_ctl(loop, EPOLL_CTL_DEL, w, 0);
+}
+
+/* only from a callback of the same loop, evloop_run() returns after the
+ * current batch of events. */
+void evloop_break(struct evloop *loop)
+{
+	loop->done = 1;
+}
+
+int evloop_run(struct evloop *loop)
+{
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+	while (!loop->done) {
+		int i, n;
+
+		n = epoll_wait(loop->epfd, events, EVLOOP_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			SysError();
+			return -1;
+		}
+		loop->pending = events;
+		loop->pending_count = n;
+		for (i = 0; i < n; i++) {
+			struct evwatch *w = events[i].data.ptr;
+
+			loop->pending_next = i + 1;
+			if (w)
+				w->cb(loop, w, from_epoll(events[i].events));
+		}
+		loop->pending_count = 0;
+	}
+	return 0;
+}
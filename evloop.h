@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#define EVLOOP_READ 1
+#define EVLOOP_WRITE 2
+#define EVLOOP_EXCLUSIVE 4 /* only wake one loop sharing this fd */
+
+struct evloop;
+
+/* embed this in a larger structure and use container_of() in the callback */
+struct evwatch {
+	int fd;
+	void (*cb)(struct evloop *loop, struct evwatch *w, unsigned revents);
+};
+
+struct evloop *evloop_new(void);
+void evloop_free(struct evloop *loop);
+int evloop_add(struct evloop *loop, struct evwatch *w, unsigned events);
+int evloop_mod(struct evloop *loop, struct evwatch *w, unsigned events);
+int evloop_del(struct evloop *loop, struct evwatch *w);
+int evloop_run(struct evloop *loop);
+void evloop_break(struct evloop *loop);
+#endif
@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "logger.h"
+#include "ext.h"
+#include "filecache.h"
+
+#define FILECACHE_BUCKETS 1024
+#define FILECACHE_LOCKS 16 /* buckets are striped across these */
+
+static struct filecache_entry *buckets[FILECACHE_BUCKETS];
+static pthread_mutex_t locks[FILECACHE_LOCKS] = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+static unsigned revalidate_interval = FILECACHE_REVALIDATE;
+static unsigned entries_max = FILECACHE_ENTRIES;
+static size_t resident_max = FILECACHE_MEM_BUDGET;
+static size_t resident_max_file = FILECACHE_MEM_MAX_FILE;
+
+/* every cached entry sits on a ring swept by the clock hand. the ring and
+ * the counts are protected by clock_lock, which nests inside a stripe lock. */
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct filecache_entry *clock_hand;
+static unsigned entries_cur;
+static size_t resident_cur;
+
+static unsigned long stat_hits, stat_misses, stat_evictions;
+
+/* FNV-1a */
+static unsigned hash_path(const char *path)
+{
+	unsigned h = 2166136261u;
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static pthread_mutex_t *lock_for(unsigned hash)
+{
+	return &locks[(hash % FILECACHE_BUCKETS) % FILECACHE_LOCKS];
+}
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void entry_free(struct filecache_entry *fe)
+{
+	Debug("closing %s\n", fe->path);
+	close(fe->fd);
+	free((char*)fe->header);
+	free(fe);
+}
+
+/* read the whole file, a short read means it is changing under us. */
+static int read_all(int fd, char *buf, size_t len)
+{
+	size_t cur = 0;
+
+	while (cur < len) {
+		ssize_t res = pread(fd, buf + cur, len - cur, cur);
+
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		cur += res;
+	}
+	return 0;
+}
+
+/* format the entity headers once, and keep the file itself next to them when
+ * it is small. a request for a resident file never touches the fd. */
+static int entry_prepare(struct filecache_entry *fe)
+{
+	char header[256];
+	size_t size = fe->st.st_size;
+	int resident;
+	int len;
+	char *blob;
+
+	len = snprintf(header, sizeof(header), "Content-Type: %s\r\n",
+		fe->content_type ? fe->content_type : "text/plain");
+	if (len < 0 || (size_t)len >= sizeof(header)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	resident = size <= resident_max_file && len + size <= resident_max;
+	blob = malloc(len + (resident ? size : 0));
+	if (!blob)
+		return -1;
+	memcpy(blob, header, len);
+	fe->header = blob;
+	fe->header_len = len;
+	if (resident && !read_all(fe->fd, blob + len, size)) {
+		fe->data = blob + len;
+		fe->resident = len + size;
+	}
+	return 0;
+}
+
+static struct filecache_entry *entry_load(const char *path, unsigned hash)
+{
+	struct filecache_entry *fe;
+	size_t path_len = strlen(path) + 1;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto failure;
+	fe = calloc(1, sizeof(*fe) + path_len);
+	if (!fe)
+		goto close_and_fail;
+	if (fstat(fd, &fe->st))
+		goto free_and_fail;
+	if (!S_ISREG(fe->st.st_mode)) {
+		errno = EISDIR;
+		goto free_and_fail;
+	}
+	fe->fd = fd;
+	fe->hash = hash;
+	fe->refcount = 1;
+	fe->checked = now();
+	memcpy(fe->path, path, path_len);
+	fe->content_type = ext_content_type(fe->path);
+	if (entry_prepare(fe))
+		goto free_and_fail;
+	return fe;
+free_and_fail:
+	free(fe);
+close_and_fail:
+	close(fd);
+failure:
+	Error("%s:%s\n", path, strerror(errno));
+	return NULL;
+}
+
+/* the caller holds clock_lock. */
+static void ring_insert(struct filecache_entry *fe)
+{
+	if (!clock_hand) {
+		fe->clock_next = fe->clock_prev = fe;
+		clock_hand = fe;
+	} else {
+		/* just behind the hand, the last place it will look */
+		fe->clock_next = clock_hand;
+		fe->clock_prev = clock_hand->clock_prev;
+		fe->clock_prev->clock_next = fe;
+		clock_hand->clock_prev = fe;
+	}
+	entries_cur++;
+	resident_cur += fe->resident;
+}
+
+/* the caller holds clock_lock. */
+static void ring_remove(struct filecache_entry *fe)
+{
+	if (fe->clock_next == fe) {
+		clock_hand = NULL;
+	} else {
+		if (clock_hand == fe)
+			clock_hand = fe->clock_next;
+		fe->clock_prev->clock_next = fe->clock_next;
+		fe->clock_next->clock_prev = fe->clock_prev;
+	}
+	fe->clock_next = fe->clock_prev = NULL;
+	entries_cur--;
+	resident_cur -= fe->resident;
+}
+
+/* the caller holds the stripe lock. */
+static void bucket_remove(struct filecache_entry *fe)
+{
+	struct filecache_entry **prev;
+
+	for (prev = &buckets[fe->hash % FILECACHE_BUCKETS]; *prev;
+		prev = &(*prev)->next) {
+		if (*prev == fe) {
+			*prev = fe->next;
+			break;
+		}
+	}
+	fe->next = NULL;
+	fe->cached = 0;
+}
+
+/* remove from the table, the caller holds the stripe lock. */
+static void entry_unlink(struct filecache_entry *fe)
+{
+	bucket_remove(fe);
+	pthread_mutex_lock(&clock_lock);
+	ring_remove(fe);
+	pthread_mutex_unlock(&clock_lock);
+}
+
+static int over_budget(size_t extra)
+{
+	return entries_cur >= entries_max ||
+		resident_cur + extra > resident_max;
+}
+
+/* make room for an entry of size extra by sweeping the clock hand. recently
+ * used entries get a second chance. a victim's stripe lock is only tried,
+ * since the caller already holds one stripe lock and clock_lock. entries
+ * freed here are handed back on the victims list, so they can be closed
+ * after the locks are dropped. returns non-zero if there is room. */
+static int evict(size_t extra, pthread_mutex_t *held,
+	struct filecache_entry **victims)
+{
+	unsigned tries = 2 * entries_cur + 1;
+
+	while (over_budget(extra) && clock_hand && tries--) {
+		struct filecache_entry *fe = clock_hand;
+		pthread_mutex_t *lock = lock_for(fe->hash);
+
+		clock_hand = fe->clock_next;
+		if (lock != held && pthread_mutex_trylock(lock))
+			continue;
+		if (fe->referenced) {
+			fe->referenced = 0;
+		} else {
+			Debug("%s:evicted\n", fe->path);
+			bucket_remove(fe);
+			ring_remove(fe);
+			__atomic_add_fetch(&stat_evictions, 1, __ATOMIC_RELAXED);
+			if (!--fe->refcount) {
+				fe->next = *victims;
+				*victims = fe;
+			}
+		}
+		if (lock != held)
+			pthread_mutex_unlock(lock);
+	}
+	return !over_budget(extra);
+}
+
+/* the caller holds the stripe lock. */
+static struct filecache_entry *entry_find(const char *path, unsigned hash)
+{
+	struct filecache_entry *fe;
+
+	for (fe = buckets[hash % FILECACHE_BUCKETS]; fe; fe = fe->next)
+		if (fe->hash == hash && !strcmp(fe->path, path))
+			return fe;
+	return NULL;
+}
+
+/* drop an entry whose file changed since it was opened. the caller holds
+ * the stripe lock. */
+static int entry_stale(struct filecache_entry *fe, time_t t)
+{
+	struct stat st;
+
+	if (t - fe->checked < (time_t)revalidate_interval)
+		return 0;
+	if (!stat(fe->path, &st) && same_file(&st, &fe->st)) {
+		fe->checked = t;
+		return 0;
+	}
+	Debug("%s:changed on disk\n", fe->path);
+	entry_unlink(fe);
+	if (!--fe->refcount)
+		entry_free(fe);
+	return 1;
+}
+
+struct filecache_entry *filecache_open(const char *path)
+{
+	unsigned hash = hash_path(path);
+	pthread_mutex_t *lock = lock_for(hash);
+	struct filecache_entry *fe, *other, *victims = NULL;
+
+	pthread_mutex_lock(lock);
+	fe = entry_find(path, hash);
+	if (fe && !entry_stale(fe, now())) {
+		fe->refcount++;
+		fe->referenced = 1;
+		pthread_mutex_unlock(lock);
+		__atomic_add_fetch(&stat_hits, 1, __ATOMIC_RELAXED);
+		return fe;
+	}
+	pthread_mutex_unlock(lock);
+	__atomic_add_fetch(&stat_misses, 1, __ATOMIC_RELAXED);
+
+	/* miss, open the file without holding the lock */
+	fe = entry_load(path, hash);
+	if (!fe)
+		return NULL;
+
+	pthread_mutex_lock(lock);
+	other = entry_find(path, hash);
+	if (other) {
+		/* somebody else got there first */
+		other->refcount++;
+		pthread_mutex_unlock(lock);
+		entry_free(fe);
+		return other;
+	}
+	pthread_mutex_lock(&clock_lock);
+	if (evict(fe->resident, lock, &victims)) {
+		fe->next = buckets[hash % FILECACHE_BUCKETS];
+		buckets[hash % FILECACHE_BUCKETS] = fe;
+		ring_insert(fe);
+		fe->cached = 1;
+		fe->refcount++; /* reference held by the table */
+	}
+	/* else no room could be made, this one is private to the request */
+	pthread_mutex_unlock(&clock_lock);
+	pthread_mutex_unlock(lock);
+	while (victims) {
+		other = victims;
+		victims = other->next;
+		entry_free(other);
+	}
+	return fe;
+}
+
+void filecache_release(struct filecache_entry *fe)
+{
+	pthread_mutex_t *lock;
+	unsigned refcount;
+
+	if (!fe)
+		return;
+	lock = lock_for(fe->hash);
+	pthread_mutex_lock(lock);
+	assert(fe->refcount > 0);
+	refcount = --fe->refcount;
+	pthread_mutex_unlock(lock);
+	if (!refcount)
+		entry_free(fe);
+}
+
+/* revalidate_secs is how often a cached file is checked for changes.
+ * mem_budget bounds the file data held in memory, and files larger than
+ * mem_max_file are always sent from their descriptor. */
+void filecache_config(unsigned revalidate_secs, unsigned max_entries,
+	size_t mem_budget, size_t mem_max_file)
+{
+	revalidate_interval = revalidate_secs;
+	entries_max = max_entries;
+	resident_max = mem_budget;
+	resident_max_file = mem_max_file;
+}
+
+void filecache_stats(struct filecache_stats *stats)
+{
+	stats->hits = __atomic_load_n(&stat_hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&stat_misses, __ATOMIC_RELAXED);
+	stats->evictions = __atomic_load_n(&stat_evictions, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&clock_lock);
+	stats->entries = entries_cur;
+	stats->resident_bytes = resident_cur;
+	pthread_mutex_unlock(&clock_lock);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef FILECACHE_H
+#define FILECACHE_H
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define FILECACHE_REVALIDATE 2 /* seconds between checks of a file */
+#define FILECACHE_ENTRIES 4096 /* each one holds an fd */
+#define FILECACHE_MEM_BUDGET (32 << 20) /* file data kept in memory */
+#define FILECACHE_MEM_MAX_FILE (64 << 10) /* larger files use the fd */
+
+/* an open file shared by every request for the same path. the fd must only
+ * be used with positional I/O (pread, sendfile with an offset). */
+struct filecache_entry {
+	int fd;
+	struct stat st;
+	const char *content_type;
+	/* the Content-Type line, ready to send */
+	const char *header;
+	size_t header_len;
+	/* the whole file when it is small enough, or NULL */
+	const char *data;
+	/* private */
+	struct filecache_entry *next;
+	struct filecache_entry *clock_next, *clock_prev;
+	unsigned hash;
+	unsigned refcount;
+	int cached; /* the table holds a reference */
+	int referenced; /* used since the clock hand last passed */
+	size_t resident; /* bytes counted against the memory budget */
+	time_t checked;
+	char path[];
+};
+
+struct filecache_stats {
+	unsigned long hits, misses, evictions;
+	unsigned entries;
+	size_t resident_bytes;
+};
+
+void filecache_config(unsigned revalidate_secs, unsigned max_entries,
+	size_t mem_budget, size_t mem_max_file);
+struct filecache_entry *filecache_open(const char *path);
+void filecache_release(struct filecache_entry *fe);
+void filecache_stats(struct filecache_stats *stats);
+#endif
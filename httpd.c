@@ -14,23 +14,54 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include "logger.h"
+#include "container_of.h"
 #include "httpd.h"
+#include "evloop.h"
 #include "net.h"
 #include "httpparser.h"
 #include "channel.h"
 #include "service.h"
 #include "module.h"
 #include "env.h"
+#include "ring.h"
+#include "slab.h"
 
 #define HTTPD_METHOD_MAX 16
 #define HTTPD_URI_MAX 512
+#define HTTPD_ACCEPT_BATCH 16 /* connections taken per listener wakeup */
+#define HTTPD_ACCEPT_PAUSE_MS 100 /* out of descriptors, stop accepting */
+#define HTTPD_SLAB_CHUNK 16 /* httpchannels allocated together */
+#define HTTPD_QUEUE_DEFAULT 1024 /* acceptor queue of an elastic pool */
+#define ELASTIC_TICK_MS 250
+#define ELASTIC_IDLE_TICKS 20 /* spare for this long before retiring */
+#define LATENCY_BUCKETS 32 /* powers of two microseconds */
+#define HTTPD_WAKE_SIGNAL SIGUSR1 /* interrupts blocking calls */
+#define HTTPD_LISTEN_ENV "HTTPD_LISTEN_FDS" /* listeners for an upgrade */
+#define HTTPD_READY_ENV "HTTPD_READY_FD" /* written once serving */
+#define HTTPD_UPGRADE_TIMEOUT 30000 /* milliseconds for the new process */
+#define HTTPD_STATUS_MIN 100
+#define HTTPD_STATUS_MAX 599
+#define HTTPD_DATE_MAX 40 /* "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" */
 
 struct httpchannel {
 	struct channel channel;
@@ -40,118 +71,449 @@ struct httpchannel {
 	char method[HTTPD_METHOD_MAX];
 	char uri[HTTPD_URI_MAX];
 	struct env headers;
+	unsigned requests; /* served on this connection */
+	unsigned long long started; /* microseconds, for the elastic pool */
+	int keepalive; /* connection stays open after this response */
+	int response_done;
 };
 
 struct worker {
-	pthread_t th;
 	struct server *server;
 	struct httpchannel httpchannel;
 };
 
+/* a connection owned by an event loop. between requests it is parked in
+ * a couple hundred bytes, the httpchannel is borrowed from the loop's slab
+ * only while a request is arriving or being answered. */
+struct evconn {
+	struct evwatch watch;
+	struct eventloop *el; /* the loop the connection was accepted on */
+	struct evconn *next, *prev;
+	struct httpchannel *hc; /* NULL while parked */
+	unsigned requests; /* kept while parked */
+	long deadline; /* the loop's timer closes the connection after it */
+	struct net_socket sock;
+};
+
+struct eventloop {
+	pthread_t th;
+	int index;
+	struct evloop *loop;
+	struct evwatch wake; /* an eventfd, written to start a drain */
+	struct evwatch timer; /* a timerfd, ticks once a second */
+	long now; /* monotonic seconds, as of the last tick */
+	int accept_paused; /* the listeners are off until the next tick */
+	/* every connection has the same timeout, so pushing a deadline back
+	 * moves it to the end and the list stays in deadline order */
+	struct evconn *conns, *conns_last;
+	struct slab *channels; /* lent to connections with data */
+	int stopping;
+};
+
 struct server {
-	struct worker *thread_pool;
-	unsigned num_thread_pool;
+	unsigned live, busy; /* workers of the pool */
+	unsigned retire; /* workers asked to exit */
+	int handoff; /* workers pop connections from the handoff ring */
 	struct net_listen listen_handle;
+	struct evwatch watch; /* shared by every event loop */
+	int shard; /* index in a SO_REUSEPORT group, or -1 */
 	struct server *next;
 	char *desc;
 };
 
-static struct server *server_head;
+/* tracks the group index as net_listen_group() creates listeners */
+struct shard_ctx {
+	unsigned count;
+	unsigned next;
+};
+
+static struct server *server_head, **server_tail = &server_head;
 static unsigned pool_size = 5;
+static int eventloop_count = -1; /* < 0 uses the thread pool instead */
+static unsigned keepalive_max = 100; /* requests per connection */
+static unsigned keepalive_timeout = 15; /* seconds, 0 waits forever */
+static unsigned listen_flags; /* NET_REUSEPORT, NET_CPU_STEERING */
 static pthread_once_t httpd_init_once = PTHREAD_ONCE_INIT;
+/* with a queue size, one thread per listener accepts and the pool pops */
+static unsigned handoff_size;
+static struct ring *handoff_ring;
+static sem_t handoff_ready; /* posted once for every queued connection */
+static unsigned long handoff_accepted, handoff_shed;
+static struct server handoff_pool = { .handoff = 1, .desc = "handoff" };
+/* an elastic pool resizes between min and max, 0 max keeps pool_size */
+static unsigned elastic_min, elastic_max;
+static unsigned elastic_slow_usec = 100000; /* p99 that pins a thread */
+static unsigned long latency_hist[LATENCY_BUCKETS];
+static struct eventloop *loops;
+static int num_loops;
+/* the loop run by this thread, for callbacks on shared listeners */
+static __thread struct eventloop *current_loop;
+static int stopping; /* set once by the drain */
+static unsigned drain_timeout = 30; /* seconds */
+static unsigned conn_count; /* open connections */
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+/* held while the event loops are spawned, they wait for it to start */
+static pthread_mutex_t loops_starting = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t *thread_list;
+static unsigned thread_count, thread_max;
+static unsigned thread_running; /* started and not yet returned */
+static char *const *upgrade_argv; /* run on SIGUSR2 */
+static void (*stats_report)(void); /* run on SIGHUP */
+static int ready_fd = -1; /* the process that started us waits on it */
+static int accept_failing; /* warned that descriptors ran out */
 
-static void grow(void *ptr, unsigned *max, unsigned min, size_t elem)
+static unsigned long long now_usec(void)
 {
-	size_t old = *max * elem;
+	struct timespec ts;
 
-	if (min <= old)
-		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void latency_record(unsigned long long usec)
+{
+	unsigned i = 63 - __builtin_clzll(usec | 1);
 
-	min += sizeof(intptr_t);
-	min--;
-	min |= min >> 1;
-	min |= min >> 2;
-	min |= min >> 4;
-	min |= min >> 8;
-	min |= min >> 16;
-	min++;
-	min -= sizeof(intptr_t);
-	*max = min;
-	Debug("realloc from %zd to %d\n", old, min);
-	assert(old <= min);
-	*(char**)ptr = realloc(*(char**)ptr, min * elem);
-	assert(*(void**)ptr != NULL);
-	memset(*(char**)ptr + old, 0, (min - old) * elem);
+	if (i >= LATENCY_BUCKETS)
+		i = LATENCY_BUCKETS - 1;
+	__atomic_add_fetch(&latency_hist[i], 1, __ATOMIC_RELAXED);
 }
 
-static void httpd_init(void)
+/* 99th percentile since the last call, rounded up to a power of two.
+ * 0 if no request finished. */
+static unsigned long latency_p99(void)
+{
+	unsigned long count[LATENCY_BUCKETS], total = 0, sum = 0;
+	unsigned i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		count[i] = __atomic_exchange_n(&latency_hist[i], 0,
+			__ATOMIC_RELAXED);
+		total += count[i];
+	}
+	for (i = 0; total && i < LATENCY_BUCKETS; i++) {
+		sum += count[i];
+		if (sum * 100 >= total * 99)
+			return 2UL << i;
+	}
+	return 0;
+}
+
+static int httpd_stopping(void)
+{
+	return __atomic_load_n(&stopping, __ATOMIC_RELAXED);
+}
+
+/* true if accepting stopped for lack of descriptors. the listener stays
+ * readable, so the caller has to back off instead of trying again right
+ * away. warns once, until a connection gets through. */
+static int accept_exhausted(struct server *serv, unsigned n, int err)
+{
+	if (err != EMFILE && err != ENFILE) {
+		if (n && __atomic_load_n(&accept_failing, __ATOMIC_RELAXED))
+			__atomic_store_n(&accept_failing, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (!__atomic_exchange_n(&accept_failing, 1, __ATOMIC_RELAXED))
+		Warning("%s:out of file descriptors, pausing accept\n",
+			serv->desc);
+	return 1;
+}
+
+#define STATUS_LINE(code, reason) \
+	[code - HTTPD_STATUS_MIN] = { "HTTP/1.1 " #code " " reason "\r\n", \
+		sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+
+/* status lines ready to send, indexed by code. */
+static const struct status_line {
+	const char *line;
+	size_t len;
+} status_lines[HTTPD_STATUS_MAX - HTTPD_STATUS_MIN + 1] = {
+	STATUS_LINE(100, "Continue"),
+	STATUS_LINE(101, "Switching Protocols"),
+	STATUS_LINE(200, "OK"),
+	STATUS_LINE(201, "Created"),
+	STATUS_LINE(202, "Accepted"),
+	STATUS_LINE(203, "Non-Authoritative Information"),
+	STATUS_LINE(204, "No Content"),
+	STATUS_LINE(205, "Reset Content"),
+	STATUS_LINE(206, "Partial Content"),
+	STATUS_LINE(300, "Multiple Choices"),
+	STATUS_LINE(301, "Moved Permanently"),
+	STATUS_LINE(302, "Found"),
+	STATUS_LINE(303, "See Other"),
+	STATUS_LINE(304, "Not Modified"),
+	STATUS_LINE(305, "Use Proxy"),
+	STATUS_LINE(307, "Temporary Redirect"),
+	STATUS_LINE(308, "Permanent Redirect"),
+	STATUS_LINE(400, "Bad Request"),
+	STATUS_LINE(401, "Unauthorized"),
+	STATUS_LINE(402, "Payment Required"),
+	STATUS_LINE(403, "Forbidden"),
+	STATUS_LINE(404, "Not Found"),
+	STATUS_LINE(405, "Method Not Allowed"),
+	STATUS_LINE(406, "Not Acceptable"),
+	STATUS_LINE(407, "Proxy Authentication Required"),
+	STATUS_LINE(408, "Request Timeout"),
+	STATUS_LINE(409, "Conflict"),
+	STATUS_LINE(410, "Gone"),
+	STATUS_LINE(411, "Length Required"),
+	STATUS_LINE(412, "Precondition Failed"),
+	STATUS_LINE(413, "Payload Too Large"),
+	STATUS_LINE(414, "URI Too Long"),
+	STATUS_LINE(415, "Unsupported Media Type"),
+	STATUS_LINE(416, "Range Not Satisfiable"),
+	STATUS_LINE(417, "Expectation Failed"),
+	STATUS_LINE(426, "Upgrade Required"),
+	STATUS_LINE(428, "Precondition Required"),
+	STATUS_LINE(429, "Too Many Requests"),
+	STATUS_LINE(431, "Request Header Fields Too Large"),
+	STATUS_LINE(500, "Internal Server Error"),
+	STATUS_LINE(501, "Not Implemented"),
+	STATUS_LINE(502, "Bad Gateway"),
+	STATUS_LINE(503, "Service Unavailable"),
+	STATUS_LINE(504, "Gateway Timeout"),
+	STATUS_LINE(505, "HTTP Version Not Supported"),
+};
+
+/* each thread formats the Date line at most once a second. */
+static __thread struct {
+	time_t now;
+	size_t len;
+	char line[HTTPD_DATE_MAX];
+} date_cache;
+
+static const char server_line[] = "Server: victory\r\n";
+
+static const struct status_line *status_line(int status_code)
 {
+	const struct status_line *sl;
+
+	if (status_code < HTTPD_STATUS_MIN || status_code > HTTPD_STATUS_MAX)
+		return &status_lines[500 - HTTPD_STATUS_MIN];
+	sl = &status_lines[status_code - HTTPD_STATUS_MIN];
+	if (!sl->line)
+		return &status_lines[500 - HTTPD_STATUS_MIN];
+	return sl;
 }
 
+static void date_refresh(void)
+{
+	struct timespec ts;
+	struct tm tm;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	if (date_cache.len && ts.tv_sec == date_cache.now)
+		return;
+	date_cache.now = ts.tv_sec;
+	gmtime_r(&ts.tv_sec, &tm);
+	date_cache.len = strftime(date_cache.line, sizeof(date_cache.line),
+		"Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+}
+
+/* status line, Date and Server go out with a single ch_writev(). */
 void httpd_response(struct channel *ch, int status_code)
 {
-	const char resp200[] = "HTTP/1.1 200 OK\r\n";
-	const size_t resp200_len = sizeof(resp200) - 1;
-	const char resp400[] = "HTTP/1.1 400 Bad Request\r\n";
-	const size_t resp400_len = sizeof(resp400) - 1;
-	const char resp500[] = "HTTP/1.1 500 Internal Server Error\r\n";
-	const size_t resp500_len = sizeof(resp500) - 1;
-	const char resp501[] = "HTTP/1.1 501 Not Implemented\r\n";
-	const size_t resp501_len = sizeof(resp501) - 1;
-	const char resp502[] = "HTTP/1.1 502 Bad Gateway\r\n";
-	const size_t resp502_len = sizeof(resp502) - 1;
-	const char resp503[] = "HTTP/1.1 503 Service Unavailable\r\n";
-	const size_t resp503_len = sizeof(resp503) - 1;
-	const char resp504[] = "HTTP/1.1 504 Gateway Timeout\r\n";
-	const size_t resp504_len = sizeof(resp504) - 1;
-	const char resp505[] = "HTTP/1.1 505 HTTP Version Not Supported\r\n";
-	const size_t resp505_len = sizeof(resp505) - 1;
-	const char *resp;
-	size_t resp_len;
-
-	switch (status_code) {
-	case 200: resp = resp200; resp_len = resp200_len; break;
-	case 400: resp = resp400; resp_len = resp400_len; break;
-	default:
-	case 500: resp = resp500; resp_len = resp500_len; break;
-	case 501: resp = resp501; resp_len = resp501_len; break;
-	case 502: resp = resp502; resp_len = resp502_len; break;
-	case 503: resp = resp503; resp_len = resp503_len; break;
-	case 504: resp = resp504; resp_len = resp504_len; break;
-	case 505: resp = resp505; resp_len = resp505_len; break;
-	}
-	Debug("%s:status_code=%d\n", ch->desc, status_code);
-	ch_write(ch, resp, resp_len);
+	const struct status_line *sl = status_line(status_code);
+	struct iovec iov[3];
+
+	date_refresh();
+	iov[0].iov_base = (void*)sl->line;
+	iov[0].iov_len = sl->len;
+	iov[1].iov_base = date_cache.line;
+	iov[1].iov_len = date_cache.len;
+	iov[2].iov_base = (void*)server_line;
+	iov[2].iov_len = sizeof(server_line) - 1;
+	Debug("%s:status_code=%d\n", ch_desc(ch), status_code);
+	ch_writev(ch, iov, 3);
 }
 
 void httpd_header(struct channel *ch, const char *name, const char *value)
 {
-	ch_write(ch, name, strlen(name));
-	ch_write(ch, ": ", 2);
-	ch_write(ch, value, strlen(value));
-	ch_write(ch, "\r\n", 2);
+	struct iovec iov[4] = {
+		{ (void*)name, strlen(name) },
+		{ ": ", 2 },
+		{ (void*)value, strlen(value) },
+		{ "\r\n", 2 },
+	};
+
+	ch_writev(ch, iov, 4);
 }
 
 void httpd_end_headers(struct channel *ch)
 {
-	ch_write(ch, "\r\n", 2);
+	struct httpchannel *hc = container_of(ch, struct httpchannel, channel);
+
+	static const char end_close[] = "Connection: close\r\n\r\n";
+	static const char end_keepalive[] = "Connection: keep-alive\r\n\r\n";
+
+	if (!hc->keepalive)
+		ch_write(ch, end_close, sizeof(end_close) - 1);
+	else if (hc->hp.http_major == 1 && hc->hp.http_minor == 0)
+		ch_write(ch, end_keepalive, sizeof(end_keepalive) - 1);
+	else
+		ch_write(ch, "\r\n", 2);
 }
 
-static void on_method(void *p, const char *method, const char *uri)
+/* the response is complete, either wait for the next request or close. */
+void httpd_end_response(struct channel *ch)
+{
+	struct httpchannel *hc = container_of(ch, struct httpchannel, channel);
+
+	hc->response_done = 1;
+	if (!hc->keepalive)
+		ch_done(ch);
+}
+
+/* send body memory in runs of up to CHANNEL_IOV_MAX, then each file. */
+static int httpd_send_body(struct channel *ch, const struct module_seg *segs,
+	unsigned count)
+{
+	struct iovec iov[CHANNEL_IOV_MAX];
+	unsigned i;
+	int n = 0;
+
+	for (i = 0; i < count; i++) {
+		const struct module_seg *seg = &segs[i];
+
+		if (seg->type == MODULE_SEG_MEM && seg->len) {
+			iov[n].iov_base = (void*)seg->data;
+			iov[n].iov_len = seg->len;
+			if (++n < CHANNEL_IOV_MAX)
+				continue;
+		}
+		if (n && ch_writev(ch, iov, n))
+			return -1;
+		n = 0;
+		if (seg->type == MODULE_SEG_FILE &&
+			ch_sendfile(ch, seg->fd, seg->offset, seg->len))
+			return -1;
+	}
+	if (n && ch_writev(ch, iov, n))
+		return -1;
+	return 0;
+}
+
+/* a complete response from a list of segments. header blocks follow the
+ * status line in order, then the Content-Length of the body segments. the
+ * body is left out for HEAD. what the socket can't take yet is copied, or
+ * for a file range kept open by the channel, so every release callback
+ * has run by the time this returns.
+ */
+int httpd_respond(struct channel *ch, int status_code,
+	const struct module_seg *segs, unsigned count)
+{
+	struct httpchannel *hc = container_of(ch, struct httpchannel, channel);
+	unsigned long long length = 0;
+	char length_str[24];
+	unsigned i;
+	int e = 0;
+
+	httpd_response(ch, status_code);
+	for (i = 0; i < count; i++) {
+		if (segs[i].type != MODULE_SEG_HEADER)
+			length += segs[i].len;
+		else if (ch_write(ch, segs[i].data, segs[i].len))
+			e = -1;
+	}
+	snprintf(length_str, sizeof(length_str), "%llu", length);
+	httpd_header(ch, "Content-Length", length_str);
+	httpd_end_headers(ch);
+	if (!e && strcmp(hc->method, "HEAD"))
+		e = httpd_send_body(ch, segs, count);
+	for (i = 0; i < count; i++) {
+		if (segs[i].release)
+			segs[i].release(segs[i].arg);
+	}
+	httpd_end_response(ch);
+	return e;
+}
+
+/* respond with an empty body. */
+static void httpd_error(struct httpchannel *hc, int status_code)
 {
-	struct httpchannel *hc = p;
 	struct channel *ch = &hc->channel;
 
-	snprintf(hc->method, sizeof(hc->method), "%s", method);
-	snprintf(hc->uri, sizeof(hc->uri), "%s", uri);
+	httpd_response(ch, status_code);
+	httpd_header(ch, "Content-Length", "0");
+	httpd_end_headers(ch);
+	httpd_end_response(ch);
+}
+
+/* look for a token in a comma separated header value. */
+static int has_token(const char *value, const char *token)
+{
+	size_t len = strlen(token);
+
+	while (value) {
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+		if (!strncasecmp(value, token, len) && (!value[len] ||
+			value[len] == ',' || value[len] == ' ' ||
+			value[len] == '\t'))
+			return 1;
+		value = strchr(value, ',');
+	}
+	return 0;
 }
 
-static void on_header(void *p, const char *name, const char *value)
+/* HTTP/1.1 is persistent unless asked not to be, HTTP/1.0 is the reverse. */
+static int want_keepalive(struct httpchannel *hc)
+{
+	const char *connection = env_get_known(&hc->headers, ENV_CONNECTION);
+
+	if (hc->requests >= keepalive_max || httpd_stopping())
+		return 0;
+	if (hc->hp.http_major > 1 ||
+		(hc->hp.http_major == 1 && hc->hp.http_minor >= 1))
+		return !has_token(connection, "close");
+	return has_token(connection, "keep-alive");
+}
+
+/* copy a span to a terminated string, truncating if needed */
+static void copy_span(char *dest, size_t max, const char *s, size_t len)
+{
+	if (len >= max)
+		len = max - 1;
+	memcpy(dest, s, len);
+	dest[len] = 0;
+}
+
+static void on_method(void *p, const char *method, size_t method_len,
+	const char *uri, size_t uri_len)
 {
 	struct httpchannel *hc = p;
-	struct channel *ch = &hc->channel;
 
-	env_set(&hc->headers, name, value);
+	if (elastic_max)
+		hc->started = now_usec();
+	copy_span(hc->method, sizeof(hc->method), method, method_len);
+	copy_span(hc->uri, sizeof(hc->uri), uri, uri_len);
+}
+
+static void on_header(void *p, const char *name, size_t name_len,
+	const char *value, size_t value_len)
+{
+	struct httpchannel *hc = p;
+
+	env_setn(&hc->headers, name, name_len, value, value_len);
+}
+
+/* the client holds the body back until it hears 100 Continue */
+static int expects_continue(struct httpchannel *hc)
+{
+	return httpparser_has_body(&hc->hp) && hc->hp.http_major == 1 &&
+		hc->hp.http_minor >= 1 &&
+		has_token(env_get_known(&hc->headers, ENV_EXPECT),
+			"100-continue");
+}
+
+/* a final response ahead of 100 Continue. the client may never send the
+ * body the parser is waiting for, so the connection can't be reused. */
+static void httpd_refuse(struct httpchannel *hc, int status_code)
+{
+	if (expects_continue(hc))
+		hc->keepalive = 0;
+	httpd_error(hc, status_code);
 }
 
 static void on_header_done(void *p)
@@ -161,56 +523,128 @@ static void on_header_done(void *p)
 	const struct module *mod;
 	const char *host;
 
+	hc->requests++;
+	hc->keepalive = want_keepalive(hc);
+
 	/* check host */
-	host = env_get(&hc->headers, "Host");
+	host = env_get_known(&hc->headers, ENV_HOST);
 	if (!host) {
-		httpd_response(ch, 400);
-		httpd_end_headers(ch);
-		ch_done(ch);
+		httpd_refuse(hc, 400);
 		return;
 	}
 	// TODO: pass Host to service_start
 	if (service_start(hc->method, host, hc->uri,
 		&hc->module, &hc->app_data)) {
-		Error("%s:could not find service or start module\n", ch->desc);
-		httpd_response(ch, 404);
-		// TODO: write headers
-		httpd_end_headers(ch);
-		ch_done(ch);
+		Error("%s:could not find service or start module\n",
+			ch_desc(ch));
+		httpd_refuse(hc, 404);
 		return;
 	}
-	Info("%s:connected to service.\n", ch->desc);
+	Info("%s:connected to service.\n", ch_desc(ch));
 
 	mod = hc->module;
 
 	if (!mod || !mod->on_header_done) {
-		Error("%s:could not find service or start module\n", ch->desc);
-		httpd_response(ch, 501);
-		httpd_end_headers(ch);
-		ch_done(ch);
+		Error("%s:could not find service or start module\n",
+			ch_desc(ch));
+		httpd_refuse(hc, 501);
 		return;
 	}
+	if (expects_continue(hc))
+		ch_puts(ch, "HTTP/1.1 100 Continue\r\n\r\n");
 	mod->on_header_done(ch, hc->app_data, &hc->headers);
 }
 
+/* the body goes to the module as it arrives, a length of 0 ends it. if the
+ * request was already refused the body is read and dropped. */
 static void on_data(void *p, size_t len, const void *data)
 {
-	// ignored
+	struct httpchannel *hc = p;
+	const struct module *mod = hc->module;
+
+	if (!mod || !mod->on_data || hc->channel.done)
+		return;
+	mod->on_data(&hc->channel, hc->app_data, len, data);
 }
 
-static void httpd_process(struct httpchannel *hc)
+/* prepare a persistent connection for its next request. */
+static void httpch_reset(struct httpchannel *hc)
+{
+	data_free(hc->app_data);
+	hc->app_data = NULL;
+	hc->module = NULL;
+	hc->keepalive = 0;
+	hc->response_done = 0;
+	httpparser_init(&hc->hp);
+	env_init(&hc->headers);
+}
+
+/* feed the newly filled channel buffer to the parser. a read may hold
+ * several pipelined requests, their responses are flushed together. the
+ * parser keeps partial lines itself, so the input is always consumed,
+ * unless a response is held back. then the rest waits for ch_drain(). */
+static void httpd_parse(struct httpchannel *hc)
 {
 	struct channel *ch = &hc->channel;
+	const char *buf;
+	size_t len;
+	int res;
 
-	while (!ch->done && ch_fill(ch) > 0) {
-		if (httpparser(&hc->hp, ch->buf, ch->buf_cur, hc, on_method,
-			on_header, on_header_done, on_data)) {
-			Info("%s:parse failure\n", ch->desc);
-			httpd_response(ch, 500);
-			httpd_end_headers(ch);
+	while (!ch->done && !ch_backlogged(ch) &&
+		(buf = ch_peek(ch, &len))) {
+		errno = 0;
+		res = httpparser_span(&hc->hp, buf, len,
+			hc, on_method, on_header, on_header_done, on_data);
+		if (res < 0) {
+			Info("%s:parse failure\n", ch_desc(ch));
+			hc->keepalive = 0;
+			/* a response already under way can't be replaced */
+			if (hc->module || hc->response_done)
+				ch_done(ch);
+			else /* only running out of memory is our fault */
+				httpd_error(hc, errno == ENOMEM ? 500 : 400);
+			break;
+		}
+		ch_consume(ch, res);
+		if (!hc->hp.done)
+			continue; /* the rest of the ring, or the next read */
+		if (!hc->response_done) {
+			Error("%s:module did not finish response\n",
+				ch_desc(ch));
+			ch_done(ch);
 			break;
 		}
-		ch->buf_cur = 0; /* httpparser() consumes 100% of buffer */
+		if (elastic_max)
+			latency_record(now_usec() - hc->started);
+		httpch_reset(hc);
+	}
+	ch_flush(ch);
+}
+
+/* between requests on a persistent connection. a new connection is owed
+ * its first response, the client has not seen us close it yet. */
+static int httpch_idle(struct httpchannel *hc)
+{
+	return hc->requests && httpparser_idle(&hc->hp);
+}
+
+/* a blocking read interrupted by a drain returns 0. an idle keep-alive
+ * connection closes then, a request in progress gets to finish. */
+static void httpd_process(struct httpchannel *hc)
+{
+	struct channel *ch = &hc->channel;
+	int res;
+
+	while (!ch->done) {
+		res = ch_fill(ch);
+		if (res > 0) {
+			httpd_parse(hc);
+			continue;
+		}
+		if (res < 0 || errno != EINTR)
+			break;
+		if (httpd_stopping() && httpch_idle(hc))
+			break;
 	}
 }
 
@@ -218,36 +652,186 @@ static void httpch_cleanup(struct httpchannel *hc)
 {
 	data_free(hc->app_data);
 	hc->app_data = NULL;
+	httpparser_free(&hc->hp);
 	ch_close(&hc->channel);
 }
 
-static void worker_cleanup(void *p)
+/* the buffers are left as they are, only the bookkeeping is cleared */
+static void httpch_init(struct httpchannel *hc, struct net_socket sock)
 {
-	struct httpchannel *hc = p;
+	httpparser_init(&hc->hp);
+	ch_init(&hc->channel, sock, NULL);
+	env_init(&hc->headers);
+	hc->module = NULL;
+	hc->app_data = NULL;
+	hc->method[0] = 0;
+	hc->uri[0] = 0;
+	hc->requests = 0;
+	hc->started = 0;
+	hc->keepalive = 0;
+	hc->response_done = 0;
+}
 
-	httpch_cleanup(hc);
+static void wake_handler(int sig)
+{
+	(void)sig;
 }
 
-static void httpch_init(struct httpchannel *hc, struct net_socket sock,
-	const char *desc)
+/* threads that may sleep in a system call register, so that a drain or a
+ * smaller pool can interrupt them with HTTPD_WAKE_SIGNAL. */
+static void thread_register(void)
 {
-	memset(hc, 0, sizeof(*hc));
-	httpparser_init(&hc->hp);
-	ch_init(&hc->channel, sock, desc);
-	env_init(&hc->headers);
+	pthread_t *list;
+	unsigned max;
+
+	pthread_mutex_lock(&thread_lock);
+	if (thread_count == thread_max) {
+		max = thread_max ? thread_max * 2 : 16;
+		list = realloc(thread_list, max * sizeof(*list));
+		if (!list) {
+			SysError();
+			pthread_mutex_unlock(&thread_lock);
+			return;
+		}
+		thread_list = list;
+		thread_max = max;
+	}
+	thread_list[thread_count++] = pthread_self();
+	pthread_mutex_unlock(&thread_lock);
 }
 
-static int server_accept(struct server *serv, struct httpchannel *hc)
+static void thread_unregister(void)
+{
+	pthread_t self = pthread_self();
+	unsigned i;
+
+	pthread_mutex_lock(&thread_lock);
+	for (i = 0; i < thread_count; i++) {
+		if (pthread_equal(thread_list[i], self)) {
+			thread_list[i] = thread_list[--thread_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&thread_lock);
+}
+
+/* the count is raised before the thread exists, so a drain never misses a
+ * thread that has yet to pick up its first connection. th may be NULL. */
+static int thread_spawn(pthread_t *th, void *(*start)(void *), void *arg)
+{
+	pthread_t t;
+	int e;
+
+	__atomic_add_fetch(&thread_running, 1, __ATOMIC_RELAXED);
+	e = pthread_create(&t, NULL, start, arg);
+	if (e) {
+		__atomic_sub_fetch(&thread_running, 1, __ATOMIC_RELAXED);
+		return e;
+	}
+	pthread_detach(t);
+	if (th)
+		*th = t;
+	return 0;
+}
+
+/* the last thing a thread from thread_spawn does */
+static void thread_done(void)
 {
-	char desc[64];
-	struct net_socket new_sock;
+	__atomic_sub_fetch(&thread_running, 1, __ATOMIC_RELEASE);
+}
+
+static void wake_threads(void)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&thread_lock);
+	for (i = 0; i < thread_count; i++)
+		pthread_kill(thread_list[i], HTTPD_WAKE_SIGNAL);
+	pthread_mutex_unlock(&thread_lock);
+}
+
+/* take one of the retirements asked of this pool */
+static int claim_retire(struct server *serv)
+{
+	unsigned n = __atomic_load_n(&serv->retire, __ATOMIC_RELAXED);
+
+	while (n)
+		if (__atomic_compare_exchange_n(&serv->retire, &n, n - 1, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
 
-	if (net_accept(&serv->listen_handle, &new_sock, sizeof(desc), desc))
+/* sleeps until an acceptor queues a connection, or until this idle worker
+ * is retired. a drain empties the ring before the workers exit. */
+static int handoff_pop(struct server *serv, struct net_socket *sock)
+{
+	for (;;) {
+		if (httpd_stopping()) {
+			if (sem_trywait(&handoff_ready))
+				return -1;
+			break;
+		}
+		if (!sem_wait(&handoff_ready))
+			break;
+		if (errno != EINTR) {
+			SysError();
+			return -1;
+		}
+	}
+	/* one token is posted per retirement, take it first so the
+	 * remaining tokens match the connections in the ring */
+	if (claim_retire(serv))
 		return -1;
-	httpch_init(hc, new_sock, desc);
+	/* a token means the element is claimed, though maybe not yet
+	 * written by a producer that was preempted */
+	while (ring_pop(handoff_ring, sock))
+		sched_yield();
 	return 0;
 }
 
+static void wait_readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	poll(&pfd, 1, -1);
+}
+
+/* returns -1 when the worker should exit */
+static int server_accept(struct server *serv, struct httpchannel *hc)
+{
+	struct net_socket sock;
+
+	if (serv->handoff) {
+		if (handoff_pop(serv, &sock))
+			return -1;
+	} else {
+		for (;;) {
+			if (httpd_stopping() || claim_retire(serv))
+				return -1;
+			if (!net_accept(&serv->listen_handle, &sock, 0, NULL)) {
+				accept_exhausted(serv, 1, 0);
+				break;
+			}
+			/* a listener shared with another process during an
+			 * upgrade may have been made non-blocking */
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				wait_readable(serv->listen_handle.fd);
+			else if (accept_exhausted(serv, 0, errno))
+				poll(NULL, 0, HTTPD_ACCEPT_PAUSE_MS);
+			else if (errno != EINTR)
+				return -1;
+		}
+	}
+	/* don't let an idle keep-alive client hold a thread forever */
+	net_socket_timeout(&sock, keepalive_timeout);
+	httpch_init(hc, sock);
+	__atomic_add_fetch(&conn_count, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* workers are never cancelled. they leave between connections, when the
+ * pool shrinks or the server drains, and free themselves. */
 static void *worker_start(void *p)
 {
 	struct worker *w = p;
@@ -255,76 +839,890 @@ static void *worker_start(void *p)
 	struct httpchannel *hc = &w->httpchannel;
 
 	signal(SIGPIPE, SIG_IGN);
-	pthread_cleanup_push(worker_cleanup, hc);
-	while (1) {
-		pthread_testcancel();
-		if (server_accept(serv, hc))
-			return NULL;
+	thread_register();
+	while (!server_accept(serv, hc)) {
+		__atomic_add_fetch(&serv->busy, 1, __ATOMIC_RELAXED);
 		httpd_process(hc);
-		Debug("%s:connection terminated\n", hc->channel.desc);
+		__atomic_sub_fetch(&serv->busy, 1, __ATOMIC_RELAXED);
+		Debug("%s:connection terminated\n", ch_desc(&hc->channel));
 		httpch_cleanup(hc);
+		__atomic_sub_fetch(&conn_count, 1, __ATOMIC_RELAXED);
 	}
-	pthread_cleanup_pop(1);
+	thread_unregister();
+	__atomic_sub_fetch(&serv->live, 1, __ATOMIC_RELAXED);
+	free(w);
+	thread_done();
 	return NULL;
 }
 
-static void resize_thread_pool(struct server *serv, unsigned new_size)
+static void evconn_unlink(struct eventloop *el, struct evconn *ec)
 {
-	unsigned i;
+	if (ec->next)
+		ec->next->prev = ec->prev;
+	else
+		el->conns_last = ec->prev;
+	if (ec->prev)
+		ec->prev->next = ec->next;
+	else
+		el->conns = ec->next;
+	ec->next = ec->prev = NULL;
+}
+
+/* give the connection another keepalive_timeout seconds */
+static void evconn_touch(struct eventloop *el, struct evconn *ec)
+{
+	/* now is up to a second old, round the timeout up */
+	ec->deadline = el->now + keepalive_timeout + 1;
+	if (el->conns_last == ec)
+		return;
+	if (ec->prev || el->conns == ec)
+		evconn_unlink(el, ec);
+	ec->prev = el->conns_last;
+	if (ec->prev)
+		ec->prev->next = ec;
+	else
+		el->conns = ec;
+	el->conns_last = ec;
+}
+
+static void evconn_close(struct eventloop *el, struct evconn *ec)
+{
+	char desc[NET_NAME_MAX];
+
+	Debug("%s:connection terminated\n",
+		net_socket_name(&ec->sock, desc, sizeof(desc)));
+	evconn_unlink(el, ec);
+	evloop_del(el->loop, &ec->watch);
+	if (ec->hc) {
+		httpch_cleanup(ec->hc);
+		slab_put(el->channels, ec->hc);
+	} else {
+		close(ec->sock.fd);
+	}
+	free(ec);
+	__atomic_sub_fetch(&conn_count, 1, __ATOMIC_RELAXED);
+	if (el->stopping && !el->conns)
+		evloop_break(el->loop);
+}
+
+/* data arrived on a parked connection */
+static struct httpchannel *evconn_unpark(struct eventloop *el,
+	struct evconn *ec)
+{
+	struct httpchannel *hc = slab_get(el->channels);
+
+	if (!hc)
+		return NULL;
+	httpch_init(hc, ec->sock);
+	hc->channel.nonblock = 1;
+	hc->requests = ec->requests;
+	ec->hc = hc;
+	return hc;
+}
+
+/* called once a read comes up empty with nothing of the next request
+ * seen. responses are flushed by httpd_parse(), so nothing is lost. */
+static void evconn_park(struct eventloop *el, struct evconn *ec)
+{
+	struct httpchannel *hc = ec->hc;
+
+	ec->requests = hc->requests;
+	data_free(hc->app_data);
+	httpparser_free(&hc->hp);
+	ch_release(&hc->channel);
+	slab_put(el->channels, hc);
+	ec->hc = NULL;
+}
+
+/* see httpch_idle(), a parked connection has no partial request. one
+ * with a response still queued is not idle either. */
+static int evconn_idle(struct evconn *ec)
+{
+	if (!ec->hc)
+		return ec->requests > 0;
+	return httpch_idle(ec->hc) && !ch_backlogged(&ec->hc->channel);
+}
+
+/* the deadline moves with each response, each write and a request body
+ * arriving. a header has to arrive whole within the timeout, a client
+ * can't hold the connection by sending it a byte at a time. */
+static void evconn_progress(struct eventloop *el, struct evconn *ec)
+{
+	struct httpchannel *hc = ec->hc;
+
+	if (hc && !httpparser_idle(&hc->hp) && !hc->module &&
+		!hc->response_done && !ch_backlogged(&hc->channel))
+		return;
+	evconn_touch(el, ec);
+}
+
+/* readable, or writable while a response is queued. the loop never waits
+ * on one client: output the socket won't take stays in the channel's
+ * backlog, and the connection watches for EVLOOP_WRITE instead of reading
+ * more requests until it is sent. */
+static void evconn_cb(struct evloop *loop, struct evwatch *w,
+	unsigned revents)
+{
+	struct evconn *ec = container_of(w, struct evconn, watch);
+	struct eventloop *el = ec->el;
+	struct httpchannel *hc = ec->hc;
+	struct channel *ch;
+
+	(void)revents;
+	if (!hc && !(hc = evconn_unpark(el, ec))) {
+		evconn_close(el, ec);
+		return;
+	}
+	ch = &hc->channel;
+	if (ch_backlogged(ch)) {
+		/* a hangup is reported as readable, the send will fail */
+		if (ch_drain(ch) > 0) {
+			evconn_touch(el, ec);
+			return;
+		}
+		if (ch->done) {
+			evconn_close(el, ec);
+			return;
+		}
+		evloop_mod(loop, w, EVLOOP_READ);
+		/* requests that arrived behind the queued response */
+		httpd_parse(hc);
+	}
+	while (!ch->done && !ch_backlogged(ch)) {
+		int res = ch_fill(ch);
+
+		if (res == 0) {
+			/* drained, wait for the next wakeup */
+			if (httpparser_idle(&hc->hp) && !ch_pending(ch))
+				evconn_park(el, ec);
+			evconn_progress(el, ec);
+			return;
+		}
+		if (res < 0)
+			break;
+		httpd_parse(hc);
+	}
+	if (ch_backlogged(ch) && !ch->error &&
+		!evloop_mod(loop, w, EVLOOP_WRITE)) {
+		evconn_touch(el, ec);
+		return;
+	}
+	evconn_close(el, ec);
+}
+
+/* shared listeners are watched by every loop, a SO_REUSEPORT listener only
+ * by the loop with the same index. */
+static int eventloop_listen(struct eventloop *el, int on)
+{
+	struct server *serv;
+	int e;
+
+	for (serv = server_head; serv; serv = serv->next) {
+		if (serv->shard >= 0 && serv->shard != el->index)
+			continue;
+		if (!on)
+			e = evloop_del(el->loop, &serv->watch);
+		else if (serv->shard < 0)
+			e = evloop_add(el->loop, &serv->watch,
+				EVLOOP_READ | EVLOOP_EXCLUSIVE);
+		else
+			e = evloop_add(el->loop, &serv->watch, EVLOOP_READ);
+		if (e)
+			return -1;
+	}
+	return 0;
+}
+
+/* the next tick comes after msec, then once a second */
+static int eventloop_timer_arm(struct eventloop *el, long msec)
+{
+	struct itimerspec its = {
+		{ 1, 0 }, { msec / 1000, msec % 1000 * 1000000 },
+	};
+
+	if (timerfd_settime(el->timer.fd, 0, &its, NULL)) {
+		SysError();
+		return -1;
+	}
+	return 0;
+}
+
+static void server_accept_cb(struct evloop *loop, struct evwatch *w,
+	unsigned revents)
+{
+	struct server *serv = container_of(w, struct server, watch);
+	struct eventloop *el = current_loop;
+	struct net_socket socks[HTTPD_ACCEPT_BATCH];
+	char desc[NET_NAME_MAX];
+	unsigned i, n;
+
+	(void)revents;
+	n = net_accept_batch(&serv->listen_handle, socks, HTTPD_ACCEPT_BATCH,
+		NET_NONBLOCK);
+	if (accept_exhausted(serv, n, n < HTTPD_ACCEPT_BATCH ? errno : 0) &&
+		!el->accept_paused) {
+		/* the timer turns the listeners back on */
+		el->accept_paused = 1;
+		eventloop_listen(el, 0);
+		eventloop_timer_arm(el, HTTPD_ACCEPT_PAUSE_MS);
+	}
+	for (i = 0; i < n; i++) {
+		struct evconn *ec;
+
+		ec = calloc(1, sizeof(*ec));
+		if (!ec) {
+			Error("%s:dropping connection\n",
+				net_socket_name(&socks[i], desc, sizeof(desc)));
+			close(socks[i].fd);
+			continue;
+		}
+		ec->el = el;
+		ec->sock = socks[i];
+		ec->watch.fd = socks[i].fd;
+		ec->watch.cb = evconn_cb;
+		if (evloop_add(loop, &ec->watch, EVLOOP_READ)) {
+			close(socks[i].fd);
+			free(ec);
+			continue;
+		}
+		__atomic_add_fetch(&conn_count, 1, __ATOMIC_RELAXED);
+		evconn_touch(el, ec);
+	}
+}
+
+/* the loop's listeners are dropped on the first wakeup of a drain, then
+ * idle keep-alive connections are closed on every wakeup. the loop ends
+ * with its last connection. */
+static void eventloop_wake_cb(struct evloop *loop, struct evwatch *w,
+	unsigned revents)
+{
+	struct eventloop *el = container_of(w, struct eventloop, wake);
+	struct evconn *ec, *next;
+	eventfd_t n;
+
+	(void)revents;
+	eventfd_read(el->wake.fd, &n);
+	if (!httpd_stopping())
+		return;
+	if (!el->stopping) {
+		el->stopping = 1;
+		if (!el->accept_paused)
+			eventloop_listen(el, 0);
+	}
+	for (ec = el->conns; ec; ec = next) {
+		next = ec->next;
+		if (evconn_idle(ec))
+			evconn_close(el, ec);
+	}
+	if (!el->conns)
+		evloop_break(loop);
+}
+
+/* once a second, close the connections whose deadline has passed. a slow
+ * reader is closed the same as an idle client, neither makes progress.
+ * listeners paused for lack of descriptors are watched again. */
+static void eventloop_timer_cb(struct evloop *loop, struct evwatch *w,
+	unsigned revents)
+{
+	struct eventloop *el = container_of(w, struct eventloop, timer);
+	char desc[NET_NAME_MAX];
+	uint64_t ticks;
+
+	(void)loop;
+	(void)revents;
+	if (read(w->fd, &ticks, sizeof(ticks)) < 0)
+		return;
+	el->now = now_usec() / 1000000;
+	if (el->accept_paused) {
+		el->accept_paused = 0;
+		if (!el->stopping)
+			eventloop_listen(el, 1);
+	}
+	while (keepalive_timeout && el->conns &&
+		el->conns->deadline <= el->now) {
+		Debug("%s:timed out\n", net_socket_name(&el->conns->sock,
+			desc, sizeof(desc)));
+		evconn_close(el, el->conns);
+	}
+}
+
+static int eventloop_timer(struct eventloop *el)
+{
+	el->now = now_usec() / 1000000;
+	el->timer.fd = timerfd_create(CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC);
+	if (el->timer.fd < 0) {
+		SysError();
+		return -1;
+	}
+	el->timer.cb = eventloop_timer_cb;
+	if (eventloop_timer_arm(el, 1000))
+		return -1;
+	return evloop_add(el->loop, &el->timer, EVLOOP_READ);
+}
+
+static void *eventloop_start(void *p)
+{
+	struct eventloop *el = p;
+
+	current_loop = el;
+	signal(SIGPIPE, SIG_IGN);
+	pthread_mutex_lock(&loops_starting);
+	pthread_mutex_unlock(&loops_starting);
+	evloop_run(el->loop);
+	thread_done();
+	return NULL;
+}
+
+static int cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n < 1 ? 1 : n;
+}
+
+static int eventloop_total(void)
+{
+	return eventloop_count > 0 ? eventloop_count : cpu_count();
+}
+
+/* number of listeners in each SO_REUSEPORT group. */
+static unsigned worker_groups(void)
+{
+	unsigned n;
+
+	if (eventloop_count >= 0)
+		return eventloop_total();
+	/* split the thread pool into one group per CPU */
+	n = cpu_count();
+	return n < pool_size ? n : pool_size ? pool_size : 1;
+}
+
+static void pin_to_cpu(pthread_t th, int cpu)
+{
+	cpu_set_t set;
+	int e;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	e = pthread_setaffinity_np(th, sizeof(set), &set);
+	if (e)
+		Warning("unable to pin thread to cpu %d:%s\n", cpu,
+			strerror(e));
+}
+
+/* the kernel keeps handing connections to a SO_REUSEPORT listener nobody
+ * accepts on. close the shards from first on, their loops did not start. */
+static void server_close_shards(int first)
+{
+	struct server **prev = &server_head, *serv;
+
+	while ((serv = *prev)) {
+		if (serv->shard < first) {
+			prev = &serv->next;
+			continue;
+		}
+		Warning("%s:closing listener %d, no loop serves it\n",
+			serv->desc, serv->shard);
+		*prev = serv->next;
+		close(serv->listen_handle.fd);
+		free(serv->desc);
+		free(serv);
+	}
+	server_tail = prev;
+}
+
+/* one loop per core, each watching the listeners eventloop_listen() picks */
+static int eventloop_run_all(void)
+{
+	int i, n = eventloop_total();
 	int e;
-	unsigned old_size = serv->num_thread_pool;
 
-	/* remove threads if we shrink */
-	// TODO: prefer idle/sleep threads
-	for (i = new_size; i < old_size; i++) {
-		e = pthread_cancel(serv->thread_pool[i].th);
+	loops = calloc(n, sizeof(*loops));
+	if (!loops) {
+		SysError();
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		loops[i].index = i;
+		loops[i].loop = evloop_new();
+		if (!loops[i].loop)
+			return -1;
+		loops[i].wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		loops[i].wake.cb = eventloop_wake_cb;
+		loops[i].channels = slab_new(sizeof(struct httpchannel),
+			HTTPD_SLAB_CHUNK);
+		if (!loops[i].channels)
+			return -1;
+		if (loops[i].wake.fd < 0) {
+			SysError();
+			return -1;
+		}
+		if (evloop_add(loops[i].loop, &loops[i].wake, EVLOOP_READ) ||
+			eventloop_timer(&loops[i]) ||
+			eventloop_listen(&loops[i], 1))
+			return -1;
+	}
+	Info("starting %d event loops\n", n);
+	/* inherited listeners can have connections waiting already, the
+	 * loops wait until the list of listeners is final */
+	num_loops = n;
+	pthread_mutex_lock(&loops_starting);
+	for (i = 0; i < n; i++) {
+		e = thread_spawn(&loops[i].th, eventloop_start, &loops[i]);
 		if (e) {
-			perror(serv->desc);
+			Warning("limiting event loops to %d\n", i);
+			num_loops = i;
+			server_close_shards(i);
 			break;
 		}
+		/* steered packets must be handled on the receiving CPU */
+		if (listen_flags & NET_CPU_STEERING)
+			pin_to_cpu(loops[i].th, i % cpu_count());
 	}
-	grow(&serv->thread_pool, &serv->num_thread_pool, new_size,
-		sizeof(*serv->thread_pool));
-	/* add threads if we grow */
-	for (i = old_size; i < new_size; i++) {
-		struct worker *w = &serv->thread_pool[i];
+	pthread_mutex_unlock(&loops_starting);
+	return i ? 0 : -1;
+}
 
-		w->server = serv;
-		e = pthread_create(&w->th, NULL, worker_start, w);
-		if (e) {
+/* the pool is hopelessly behind, refuse rather than queue forever */
+static void acceptor_shed(struct net_socket *sock)
+{
+	static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+		"Content-Length: 0\r\nConnection: close\r\n\r\n";
+	char desc[NET_NAME_MAX];
+
+	Debug("%s:queue full, shedding connection\n",
+		net_socket_name(sock, desc, sizeof(desc)));
+	send(sock->fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(sock->fd);
+	__atomic_add_fetch(&handoff_shed, 1, __ATOMIC_RELAXED);
+}
+
+/* drains a non-blocking listener into the handoff ring on every wakeup */
+static void *acceptor_start(void *p)
+{
+	struct server *serv = p;
+	struct pollfd pfd = { .fd = serv->listen_handle.fd, .events = POLLIN };
+	struct net_socket socks[HTTPD_ACCEPT_BATCH];
+	unsigned i, n;
+	int err;
+
+	thread_register();
+	while (!httpd_stopping()) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
 			perror(serv->desc);
-			/* the list came up short */
-			serv->num_thread_pool = i;
-			Warning("limiting thread pool to %d\n",
-				serv->num_thread_pool);
 			break;
 		}
-		e = pthread_detach(w->th);
+		do {
+			n = net_accept_batch(&serv->listen_handle, socks,
+				HTTPD_ACCEPT_BATCH, 0);
+			err = n < HTTPD_ACCEPT_BATCH ? errno : 0;
+			for (i = 0; i < n; i++) {
+				if (ring_push(handoff_ring, &socks[i])) {
+					acceptor_shed(&socks[i]);
+					continue;
+				}
+				__atomic_add_fetch(&handoff_accepted, 1,
+					__ATOMIC_RELAXED);
+				sem_post(&handoff_ready);
+			}
+		} while (n == HTTPD_ACCEPT_BATCH);
+		if (accept_exhausted(serv, n, err))
+			poll(NULL, 0, HTTPD_ACCEPT_PAUSE_MS);
+	}
+	thread_unregister();
+	thread_done();
+	return NULL;
+}
+
+static int handoff_init(void)
+{
+	handoff_ring = ring_new(handoff_size, sizeof(struct net_socket));
+	if (!handoff_ring)
+		return -1;
+	if (sem_init(&handoff_ready, 0, 0)) {
+		SysError();
+		return -1;
+	}
+	return 0;
+}
+
+/* workers are allocated one at a time, so they can come and go without
+ * moving each other. */
+static unsigned pool_spawn(struct server *serv, unsigned n)
+{
+	unsigned i;
+	int e;
+
+	for (i = 0; i < n; i++) {
+		struct worker *w = calloc(1, sizeof(*w));
+
+		if (!w) {
+			SysError();
+			break;
+		}
+		w->server = serv;
+		__atomic_add_fetch(&serv->live, 1, __ATOMIC_RELAXED);
+		e = thread_spawn(NULL, worker_start, w);
 		if (e) {
-			perror(serv->desc);
-			// TODO: handle the error
+			Warning("%s:unable to add a worker:%s\n", serv->desc,
+				strerror(e));
+			__atomic_sub_fetch(&serv->live, 1, __ATOMIC_RELAXED);
+			free(w);
+			break;
 		}
+	}
+	return i;
+}
+
+/* idle workers take the retirements first, busy ones are never
+ * interrupted and exit once they are between connections. */
+static void pool_retire(struct server *serv, unsigned n)
+{
+	unsigned i;
 
+	__atomic_add_fetch(&serv->retire, n, __ATOMIC_RELAXED);
+	if (!serv->handoff) {
+		wake_threads(); /* out of accept() */
+		return;
 	}
+	for (i = 0; i < n; i++)
+		sem_post(&handoff_ready);
+}
+
+/* workers not yet asked to retire */
+static unsigned pool_live(struct server *serv)
+{
+	unsigned live = __atomic_load_n(&serv->live, __ATOMIC_RELAXED);
+	unsigned retire = __atomic_load_n(&serv->retire, __ATOMIC_RELAXED);
 
+	return live > retire ? live - retire : 0;
 }
 
-static void server_add_entry(struct net_listen listen_handle, const char *desc)
+static void resize_thread_pool(struct server *serv, unsigned new_size)
+{
+	unsigned live = pool_live(serv), n;
+
+	if (new_size < live) {
+		pool_retire(serv, live - new_size);
+		return;
+	}
+	n = pool_spawn(serv, new_size - live);
+	if (n < new_size - live)
+		Warning("limiting thread pool to %u\n", live + n);
+}
+
+/* the controller. grows the pool when connections wait in the queue, or
+ * ahead of time when slow requests hold every thread. shrinks it by half
+ * of the workers that stayed spare for a whole idle window. */
+static void *elastic_start(void *p)
+{
+	struct server *serv = &handoff_pool;
+	const struct timespec tick = { 0, ELASTIC_TICK_MS * 1000000L };
+	unsigned idle_ticks = 0, spare = UINT_MAX;
+	unsigned depth, live, busy, idle, add, n;
+	unsigned long p99;
+
+	(void)p;
+	Info("elastic pool of %u to %u threads\n", elastic_min, elastic_max);
+	thread_register();
+	pool_spawn(serv, elastic_min);
+	while (!httpd_stopping()) {
+		nanosleep(&tick, NULL);
+		depth = ring_count(handoff_ring);
+		live = pool_live(serv);
+		busy = __atomic_load_n(&serv->busy, __ATOMIC_RELAXED);
+		idle = live > busy ? live - busy : 0;
+		p99 = latency_p99();
+
+		add = live < elastic_min ? elastic_min - live : 0;
+		if (depth > idle)
+			add += depth - idle;
+		else if (!idle && p99 > elastic_slow_usec)
+			add += 1 + live / 4; /* the next arrival would wait */
+		if (add > live && live >= elastic_min)
+			add = live; /* at most double on each tick */
+		if (add > elastic_max - live)
+			add = live < elastic_max ? elastic_max - live : 0;
+		if (add) {
+			n = pool_spawn(serv, add);
+			if (n)
+				Info("pool grown to %u threads (queue=%u "
+					"busy=%u p99=%luus)\n", live + n,
+					depth, busy, p99);
+			idle_ticks = 0;
+			spare = UINT_MAX;
+			continue;
+		}
+
+		if (idle < spare)
+			spare = idle;
+		if (++idle_ticks < ELASTIC_IDLE_TICKS)
+			continue;
+		n = live > elastic_min ? live - elastic_min : 0;
+		if (n > (spare + 1) / 2)
+			n = (spare + 1) / 2;
+		if (n) {
+			pool_retire(serv, n);
+			Info("pool shrunk to %u threads\n", live - n);
+		}
+		idle_ticks = 0;
+		spare = UINT_MAX;
+	}
+	thread_unregister();
+	thread_done();
+	return NULL;
+}
+
+static void server_add_entry(struct net_listen listen_handle, const char *desc,
+	int shard)
 {
 	struct server *serv;
+	unsigned threads;
 
 	serv = calloc(1, sizeof(*serv));
 	serv->listen_handle = listen_handle;
 	serv->desc = strdup(desc);
-	resize_thread_pool(serv, pool_size);
-	serv->next = server_head;
-	server_head = serv;
+	serv->shard = shard;
+	if (eventloop_count < 0 && handoff_ring) {
+		int e;
+
+		net_listen_nonblock(&serv->listen_handle);
+		e = thread_spawn(NULL, acceptor_start, serv);
+		if (e)
+			Error("%s:no acceptor thread:%s\n", desc, strerror(e));
+	} else if (eventloop_count < 0) {
+		/* a group shares the pool between its listeners */
+		threads = shard < 0 ? pool_size : pool_size / worker_groups();
+		resize_thread_pool(serv, threads ? threads : 1);
+		if (shard >= 0 && !pool_live(serv)) {
+			/* the kernel would still queue connections on it */
+			Warning("%s:closing listener %d, no thread serves it\n",
+				desc, shard);
+			close(listen_handle.fd);
+			free(serv->desc);
+			free(serv);
+			return;
+		}
+	} else {
+		net_listen_nonblock(&serv->listen_handle);
+		serv->watch.fd = listen_handle.fd;
+		serv->watch.cb = server_accept_cb;
+	}
+	/* kept in creation order, an upgrade hands them down in it */
+	*server_tail = serv;
+	server_tail = &serv->next;
 }
 
 static void _server_create(void *p, struct net_listen sock,
         size_t desc_len, const char *desc)
 {
-	server_add_entry(sock, desc);
+	struct shard_ctx *ctx = p;
+
+	(void)desc_len;
+	if (!ctx) {
+		server_add_entry(sock, desc, -1);
+		return;
+	}
+	server_add_entry(sock, desc, ctx->next);
+	ctx->next = (ctx->next + 1) % ctx->count;
+}
+
+/* handled by the thread in httpd_loop() */
+static void control_signals(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGQUIT);
+	sigaddset(set, SIGUSR2);
+	sigaddset(set, SIGHUP);
+}
+
+static void httpd_init(void)
+{
+	struct sigaction sa;
+	sigset_t set;
+	const char *env;
+
+	/* no SA_RESTART, the point is to interrupt blocking calls */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wake_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(HTTPD_WAKE_SIGNAL, &sa, NULL);
+	/* threads inherit the mask, httpd_loop() waits for these */
+	control_signals(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	/* started by an upgrade, take over the old process's listeners */
+	env = getenv(HTTPD_LISTEN_ENV);
+	if (env)
+		net_inherit(env);
+	env = getenv(HTTPD_READY_ENV);
+	if (env)
+		ready_fd = atoi(env);
+	unsetenv(HTTPD_LISTEN_ENV);
+	unsetenv(HTTPD_READY_ENV);
+}
+
+/* the environment plus the upgrade variables, built before fork() */
+/* is var "<name>=..." */
+static int env_is(const char *var, const char *name)
+{
+	size_t len = strlen(name);
+
+	return !strncmp(var, name, len) && var[len] == '=';
+}
+
+static char **upgrade_env(char *listen_var, char *ready_var)
+{
+	extern char **environ;
+	char **envp;
+	size_t n, i, j;
+
+	for (n = 0; environ[n]; n++)
+		;
+	envp = calloc(n + 3, sizeof(*envp));
+	if (!envp)
+		return NULL;
+	/* only our own variables are replaced, the rest pass through */
+	for (i = j = 0; i < n; i++)
+		if (!env_is(environ[i], HTTPD_LISTEN_ENV) &&
+			!env_is(environ[i], HTTPD_READY_ENV))
+			envp[j++] = environ[i];
+	envp[j++] = listen_var;
+	envp[j++] = ready_var;
+	return envp;
+}
+
+/* starts the new binary with our listeners and waits for it to serve. the
+ * kernel keeps queueing connections on the shared sockets, none are lost.
+ * returns 0 if the new process took over. */
+static int httpd_upgrade_exec(void)
+{
+	struct server *serv;
+	char fds[1024], ready[32];
+	char **envp;
+	size_t len;
+	int pipefd[2];
+	struct pollfd pfd;
+	sigset_t set;
+	pid_t pid;
+	int n, status;
+	char c = 0;
+
+	if (!upgrade_argv) {
+		Error("upgrade:no command line to run\n");
+		return -1;
+	}
+	/* each with its place in the SO_REUSEPORT group, see net_inherit() */
+	len = snprintf(fds, sizeof(fds), "%s=", HTTPD_LISTEN_ENV);
+	for (serv = server_head; serv && len < sizeof(fds); serv = serv->next)
+		len += snprintf(fds + len, sizeof(fds) - len, "%s%d:%d",
+			serv == server_head ? "" : ",",
+			serv->listen_handle.fd,
+			serv->shard < 0 ? 0 : serv->shard);
+	if (len >= sizeof(fds)) {
+		Error("upgrade:too many listeners\n");
+		return -1;
+	}
+	if (pipe2(pipefd, O_CLOEXEC)) {
+		SysError();
+		return -1;
+	}
+	snprintf(ready, sizeof(ready), "%s=%d", HTTPD_READY_ENV, pipefd[1]);
+	envp = upgrade_env(fds, ready);
+	if (!envp) {
+		SysError();
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	}
+	control_signals(&set);
+	sigaddset(&set, HTTPD_WAKE_SIGNAL);
+	pid = fork();
+	if (pid == 0) {
+		/* only async-signal-safe calls until exec */
+		for (serv = server_head; serv; serv = serv->next)
+			fcntl(serv->listen_handle.fd, F_SETFD, 0);
+		fcntl(pipefd[1], F_SETFD, 0);
+		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		execvpe(upgrade_argv[0], upgrade_argv, envp);
+		_exit(127);
+	}
+	close(pipefd[1]);
+	free(envp);
+	if (pid < 0) {
+		SysError();
+		close(pipefd[0]);
+		return -1;
+	}
+	Info("upgrade:started %s (pid %ld)\n", upgrade_argv[0], (long)pid);
+	/* the pipe closes without a byte if the new process dies */
+	pfd.fd = pipefd[0];
+	pfd.events = POLLIN;
+	do {
+		n = poll(&pfd, 1, HTTPD_UPGRADE_TIMEOUT);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0 || read(pipefd[0], &c, 1) != 1) {
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+		if (WIFEXITED(status))
+			Error("upgrade:new process exited with %d, "
+				"still serving\n", WEXITSTATUS(status));
+		else
+			Error("upgrade:new process %s, still serving\n",
+				n ? strsignal(WTERMSIG(status)) : "timed out");
+		close(pipefd[0]);
+		return -1;
+	}
+	close(pipefd[0]);
+	return 0;
+}
+
+/* tell the process that started us that our listeners are ready */
+static void upgrade_ready(void)
+{
+	net_inherit_close();
+	if (ready_fd < 0)
+		return;
+	if (write(ready_fd, "", 1) != 1)
+		SysError();
+	close(ready_fd);
+	ready_fd = -1;
+}
+
+/* stop accepting, close idle keep-alive connections and give requests in
+ * progress until the deadline. */
+static void httpd_drain(void)
+{
+	const struct timespec tick = { 0, 100000000L };
+	unsigned long long deadline = now_usec() + drain_timeout * 1000000ULL;
+	unsigned n;
+	int i;
+
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+	while (1) {
+		/* repeated, a thread may have been just about to block */
+		wake_threads();
+		for (i = 0; i < num_loops; i++)
+			eventfd_write(loops[i].wake.fd, 1);
+		n = __atomic_load_n(&conn_count, __ATOMIC_RELAXED);
+		if (handoff_ring)
+			n += ring_count(handoff_ring);
+		/* a thread can be between accept and counting a connection */
+		if (!n && !__atomic_load_n(&thread_running, __ATOMIC_ACQUIRE)) {
+			Info("all connections closed\n");
+			return;
+		}
+		if (now_usec() >= deadline) {
+			Warning("closing %u connections after %u seconds\n",
+				n, drain_timeout);
+			return;
+		}
+		nanosleep(&tick, NULL);
+	}
 }
 
 int httpd_poolsize(int newsize)
@@ -333,22 +1731,156 @@ int httpd_poolsize(int newsize)
 	return 0;
 }
 
+/* must be called before httpd_start(). 0 will use one loop per CPU. */
+int httpd_eventloops(int count)
+{
+	eventloop_count = count;
+	return 0;
+}
+
+/* 0 max_requests turns off persistent connections. the thread pool waits
+ * up to timeout seconds for each read. an event loop closes a connection
+ * that is idle that long, or that takes longer to send a request header. */
+int httpd_keepalive(unsigned max_requests, unsigned timeout)
+{
+	keepalive_max = max_requests;
+	keepalive_timeout = timeout;
+	return 0;
+}
+
+/* must be called before httpd_start(). opens a SO_REUSEPORT listener for
+ * each event loop or thread group. steering by receiving CPU needs event
+ * loops, each is pinned to the CPU of its listener. */
+int httpd_reuseport(int enable, int cpu_steering)
+{
+	listen_flags = 0;
+	if (enable)
+		listen_flags |= NET_REUSEPORT;
+	if (enable && cpu_steering)
+		listen_flags |= NET_CPU_STEERING;
+	return 0;
+}
+
+/* must be called before httpd_start(). instead of every thread of the pool
+ * blocking in accept(), a thread per listener queues up to queue_size
+ * connections for the pool. 0 turns the queue off. */
+int httpd_acceptor(unsigned queue_size)
+{
+	handoff_size = queue_size;
+	return 0;
+}
+
+/* must be called before httpd_start(). the pool starts with min_threads
+ * and grows up to max_threads under load, fed by the acceptor queue. 0
+ * max_threads keeps the pool at the size given to httpd_poolsize(). */
+int httpd_elastic(unsigned min_threads, unsigned max_threads)
+{
+	elastic_min = min_threads ? min_threads : 1;
+	elastic_max = max_threads;
+	if (elastic_max && elastic_max < elastic_min)
+		elastic_max = elastic_min;
+	return 0;
+}
+
+/* how long SIGTERM or SIGQUIT waits for requests in progress. */
+int httpd_drain_timeout(unsigned seconds)
+{
+	drain_timeout = seconds;
+	return 0;
+}
+
+/* called from httpd_loop() on SIGHUP, to log whatever the program counts */
+int httpd_stats_report(void (*report)(void))
+{
+	stats_report = report;
+	return 0;
+}
+
+/* the command line SIGUSR2 runs to replace this process. it is given the
+ * listening sockets, then this process drains and httpd_loop() returns. */
+int httpd_upgrade(char *const argv[])
+{
+	upgrade_argv = argv;
+	return 0;
+}
+
+void httpd_queue_stats(struct httpd_queue_stats *stats)
+{
+	stats->depth = handoff_ring ? ring_count(handoff_ring) : 0;
+	stats->accepted = __atomic_load_n(&handoff_accepted, __ATOMIC_RELAXED);
+	stats->shed = __atomic_load_n(&handoff_shed, __ATOMIC_RELAXED);
+	stats->workers = __atomic_load_n(&handoff_pool.live, __ATOMIC_RELAXED);
+	stats->busy = __atomic_load_n(&handoff_pool.busy, __ATOMIC_RELAXED);
+}
+
 int httpd_start(const char *node, const char *service)
 {
-	if (net_listen(_server_create, NULL, node, service))
+	struct shard_ctx ctx = { worker_groups(), 0 };
+	int e;
+
+	pthread_once(&httpd_init_once, httpd_init);
+	if (eventloop_count >= 0)
+		elastic_max = 0;
+	else if (elastic_max && !handoff_size)
+		handoff_size = HTTPD_QUEUE_DEFAULT;
+	if (eventloop_count < 0 && handoff_size && !handoff_ring
+		&& handoff_init())
 		return -1;
+	if (eventloop_count < 0 && (listen_flags & NET_CPU_STEERING)) {
+		/* pool threads run anywhere, steering would gain nothing */
+		Warning("CPU steering needs event loops, not attaching it\n");
+		listen_flags &= ~NET_CPU_STEERING;
+	}
+	if (!(listen_flags & NET_REUSEPORT)) {
+		e = net_listen(_server_create, NULL, node, service);
+	} else {
+		Info("listening with %u SO_REUSEPORT sockets per address\n",
+			ctx.count);
+		e = net_listen_group(_server_create, &ctx, node, service,
+			ctx.count, listen_flags);
+	}
+	if (e)
+		return -1;
+	/* one pool for every listener, the elastic one starts in the loop */
+	if (handoff_ring && server_head && !elastic_max)
+		resize_thread_pool(&handoff_pool, pool_size);
 	return 0;
 }
 
+/* serves until SIGTERM or SIGQUIT, then drains and returns. */
 int httpd_loop(void)
 {
-	pthread_once(&httpd_init_once, httpd_init);
-	if (server_head) {
-		struct worker w;
+	sigset_t set;
+	int sig, e;
 
-		memset(&w, 0, sizeof(w));
-		w.server = server_head;
-		worker_start(&w); /* join the last thread pool */
+	pthread_once(&httpd_init_once, httpd_init);
+	if (!server_head)
+		return 0;
+	if (eventloop_count >= 0 && eventloop_run_all())
+		return -1;
+	if (eventloop_count < 0 && elastic_max) {
+		e = thread_spawn(NULL, elastic_start, NULL);
+		if (e) {
+			Error("no pool controller:%s\n", strerror(e));
+			return -1;
+		}
+	}
+	upgrade_ready();
+	control_signals(&set);
+	while (1) {
+		if (sigwait(&set, &sig))
+			continue;
+		if (sig == SIGHUP) {
+			if (stats_report)
+				stats_report();
+			continue;
+		}
+		if (sig != SIGUSR2)
+			break;
+		if (!httpd_upgrade_exec())
+			break; /* the new process is serving */
 	}
+	Info("%s, draining connections\n", strsignal(sig));
+	httpd_drain();
 	return 0;
 }
@@ -17,11 +17,31 @@
 #define HTTPD_H
 #include "channel.h"
 
+struct module_seg;
+
+struct httpd_queue_stats {
+	unsigned depth; /* connections waiting for a worker */
+	unsigned long accepted, shed;
+	unsigned workers, busy; /* of an elastic pool */
+};
+
 int httpd_poolsize(int newsize);
+int httpd_acceptor(unsigned queue_size);
+int httpd_elastic(unsigned min_threads, unsigned max_threads);
+int httpd_drain_timeout(unsigned seconds);
+int httpd_upgrade(char *const argv[]);
+int httpd_stats_report(void (*report)(void));
+int httpd_eventloops(int count);
+int httpd_reuseport(int enable, int cpu_steering);
+int httpd_keepalive(unsigned max_requests, unsigned timeout);
 int httpd_start(const char *node, const char *service);
 int httpd_loop(void);
+void httpd_queue_stats(struct httpd_queue_stats *stats);
 
 void httpd_response(struct channel *ch, int status_code);
 void httpd_header(struct channel *ch, const char *name, const char *value);
 void httpd_end_headers(struct channel *ch);
+void httpd_end_response(struct channel *ch);
+int httpd_respond(struct channel *ch, int status_code,
+	const struct module_seg *segs, unsigned count);
 #endif
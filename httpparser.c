@@ -16,6 +16,13 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_SIMD_SCAN 1
+# include <immintrin.h>
+#endif
 #include "logger.h"
 #include "httpparser.h"
 
@@ -32,106 +39,420 @@ enum state {
 	S_REQUESTHEADER_EOL,
 	S_REQUESTHEADER_BLANKLINE,
 	S_DATA,
+	S_CHUNK_SIZE,
+	S_CHUNK_EXT,
+	S_CHUNK_SIZE_LF,
+	S_CHUNK_DATA_CR,
+	S_CHUNK_DATA_LF,
+	S_TRAILER_FIRSTCHAR,
+	S_TRAILER,
+	S_TRAILER_END_LF,
+	S_DONE,
 };
 
-static inline int tok_add(char *buf, unsigned *cur, unsigned max, char ch)
+/* scanners return the offset of the first a, b or c in s, or len. */
+static size_t scan_scalar(const char *s, size_t len, char a, char b, char c)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (s[i] == a || s[i] == b || s[i] == c)
+			break;
+	return i;
+}
+
+#ifdef HAVE_SIMD_SCAN
+/* pcmpestri can match a set of bytes in one instruction, but it is slower
+ * than three compares and an or. */
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *s, size_t len, char a, char b, char c)
+{
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	const __m128i vc = _mm_set1_epi8(c);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, va),
+				_mm_cmpeq_epi8(v, vb)),
+			_mm_cmpeq_epi8(v, vc));
+		unsigned mask = _mm_movemask_epi8(m);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scan_scalar(s + i, len - i, a, b, c);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *s, size_t len, char a, char b, char c)
+{
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+	const __m256i vc = _mm256_set1_epi8(c);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+				_mm256_cmpeq_epi8(v, vb)),
+			_mm256_cmpeq_epi8(v, vc));
+		unsigned mask = _mm256_movemask_epi8(m);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	/* finish here rather than in scan_sse2(), its legacy SSE encoding
+	 * would pay for the dirty upper halves of the ymm registers. */
+	if (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(
+				_mm_cmpeq_epi8(v, _mm256_castsi256_si128(va)),
+				_mm_cmpeq_epi8(v, _mm256_castsi256_si128(vb))),
+			_mm_cmpeq_epi8(v, _mm256_castsi256_si128(vc)));
+		unsigned mask = _mm_movemask_epi8(m);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+	return i + scan_scalar(s + i, len - i, a, b, c);
+}
+#endif
+
+enum scan_kernel { SCAN_UNKNOWN, SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+static enum scan_kernel scan_kernel;
+
+static enum scan_kernel scan_select(void)
 {
-	if (*cur < max) {
-		buf[*cur] = ch;
-		(*cur)++;
+	enum scan_kernel k = SCAN_SCALAR;
+
+#ifdef HAVE_SIMD_SCAN
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		k = SCAN_AVX2;
+	else if (__builtin_cpu_supports("sse2"))
+		k = SCAN_SSE2;
+#endif
+	__atomic_store_n(&scan_kernel, k, __ATOMIC_RELAXED);
+	return k;
+}
+
+/* the kernel is picked the first time one is needed. */
+static inline size_t scan(const char *s, size_t len, char a, char b, char c)
+{
+	enum scan_kernel k = __atomic_load_n(&scan_kernel, __ATOMIC_RELAXED);
+
+	if (k == SCAN_UNKNOWN)
+		k = scan_select();
+	switch (k) {
+#ifdef HAVE_SIMD_SCAN
+	case SCAN_AVX2:
+		return scan_avx2(s, len, a, b, c);
+	case SCAN_SSE2:
+		return scan_sse2(s, len, a, b, c);
+#endif
+	default:
+		return scan_scalar(s, len, a, b, c);
+	}
+}
+
+/* skip ahead to the next byte that can end the token in this state. */
+static size_t scan_token(enum state state, const char *s, size_t len)
+{
+	switch (state) {
+	case S_REQUESTLINE_URI:
+		return scan(s, len, ' ', '\r', '\n');
+	case S_REQUESTHEADER_FIELDNAME:
+		return scan(s, len, ':', '\r', '\n');
+	case S_REQUESTHEADER_FIELDVALUE:
+		return scan(s, len, '\r', '\n', '\r');
+	default:
 		return 0;
 	}
+}
+
+/* save the part of a line that is in this buffer. */
+static int tok_append(struct httpparser *hp, const char *seg, size_t n)
+{
+	if (hp->cur_tok + n > hp->max_tok) {
+		unsigned max = hp->max_tok ? hp->max_tok : 256;
+		char *tok;
+
+		while (max < hp->cur_tok + n)
+			max *= 2;
+		tok = realloc(hp->tok, max);
+		if (!tok)
+			return -1;
+		hp->tok = tok;
+		hp->max_tok = max;
+	}
+	memcpy(hp->tok + hp->cur_tok, seg, n);
+	hp->cur_tok += n;
+	return 0;
+}
+
+void httpparser_free(struct httpparser *hp)
+{
+	free(hp->tok);
+	hp->tok = NULL;
+	hp->cur_tok = 0;
+	hp->max_tok = 0;
+}
+
+/* where the current line starts. cur is the byte being parsed, every byte
+ * before it on the line is in the buffer at seg, unless the line began in an
+ * earlier call, then the new bytes are appended to the saved part. */
+static const char *line_base(struct httpparser *hp, const char **seg,
+	const char *cur)
+{
+	if (!hp->tok)
+		return *seg;
+	if (tok_append(hp, *seg, cur - *seg))
+		return NULL;
+	*seg = cur;
+	return hp->tok;
+}
+
+static void line_next(struct httpparser *hp, const char **seg,
+	const char *next)
+{
+	hp->line_len = 0;
+	*seg = next;
+	if (hp->tok)
+		httpparser_free(hp);
+}
+
+static int hexdigit(char ch)
+{
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	if (ch >= 'a' && ch <= 'f')
+		return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F')
+		return ch - 'A' + 10;
 	return -1;
 }
 
-static inline void tok_rewind(unsigned *cur)
+/* NUL and the other control characters, except tab, have no place in a
+ * header. passed along, they can forge fields further down the line. */
+static int has_ctl(const char *s, size_t len)
 {
-	*cur = 0;
+	while (len--) {
+		unsigned char c = *s++;
+
+		if ((c < 0x20 && c != '\t') || c == 0x7f)
+			return 1;
+	}
+	return 0;
 }
 
-static int process_header(struct httpparser *hp,
-	const char *name, const char *value)
+/* the headers that frame the body. a request may carry one or the other,
+ * that is checked once all of them are seen. */
+static int process_header(struct httpparser *hp, const char *name,
+	size_t name_len, const char *value, size_t value_len)
 {
-#if 0
-	if (!strcmp(name, "Content-Length")) {
-		char *endptr;
-		long long len = strtoll(value, &endptr, 10)
+	if (has_ctl(name, name_len) || has_ctl(value, value_len))
+		return -1;
+	while (value_len && (value[value_len - 1] == ' ' ||
+		value[value_len - 1] == '\t'))
+		value_len--;
+	if (name_len == 14 && !strncasecmp(name, "Content-Length", 14)) {
+		long long len = 0;
+		size_t i;
 
-		if (*endptr) /* parse error */
+		if (!value_len)
+			return -1;
+		for (i = 0; i < value_len; i++) {
+			if (!isdigit(value[i]) || len > (LLONG_MAX - 9) / 10)
+				return -1;
+			len = len * 10 + (value[i] - '0');
+		}
+		/* two different lengths could be a smuggling attempt */
+		if (hp->content_length_remaining >= 0 &&
+			hp->content_length_remaining != len)
 			return -1;
 		hp->content_length_remaining = len;
+	} else if (name_len == 17 &&
+		!strncasecmp(name, "Transfer-Encoding", 17)) {
+		/* chunked has to be the last coding, nothing else is
+		 * understood here */
+		if (value_len < 7 || strncasecmp(value + value_len - 7,
+			"chunked", 7))
+			return -1;
+		if (value_len > 7 && value[value_len - 8] != ',' &&
+			value[value_len - 8] != ' ')
+			return -1;
+		hp->chunked = 1;
 	}
-#endif
 	return 0;
 }
 
-int httpparser(struct httpparser *hp, const char *buf, size_t len, void *p,
-	void (*report_method)(void *p, const char *method, const char *uri),
-	void (*report_header)(void *p, const char *name, const char *value),
+/* parse "HTTP/<major>.<minor>" */
+static int process_version(struct httpparser *hp, const char *version,
+	size_t len)
+{
+	if (len != 8 || strncmp(version, "HTTP/", 5) ||
+		!isdigit(version[5]) || version[6] != '.' ||
+		!isdigit(version[7]))
+		return -1;
+	hp->http_major = version[5] - '0';
+	hp->http_minor = version[7] - '0';
+	return 0;
+}
+
+/* a header line that is entirely in the buffer is handled in one step.
+ * returns the bytes consumed, or 0 to let the state machine deal with it,
+ * which is also where errors are reported. */
+static size_t header_line(struct httpparser *hp, const char *buf, size_t len,
+	void *p,
+	void (*report_header)(void *p, const char *name, size_t name_len,
+		const char *value, size_t value_len))
+{
+	size_t name_len, value, end;
+
+	name_len = scan(buf, len, ':', '\r', '\n');
+	if (!name_len || name_len == len || buf[name_len] != ':')
+		return 0;
+	for (value = name_len + 1; value < len && buf[value] != '\r' &&
+		buf[value] != '\n' && isspace(buf[value]); value++)
+		;
+	end = value + scan(buf + value, len - value, '\r', '\n', '\r');
+	if (end + 1 >= len || end >= HTTPPARSER_LINE_MAX ||
+		buf[end] != '\r' || buf[end + 1] != '\n')
+		return 0;
+	if (process_header(hp, buf, name_len, buf + value, end - value))
+		return 0;
+	if (report_header)
+		report_header(p, buf, name_len, buf + value, end - value);
+	return end + 2;
+}
+
+int httpparser_span(struct httpparser *hp, const char *buf, size_t len,
+	void *p,
+	void (*report_method)(void *p, const char *method, size_t method_len,
+		const char *uri, size_t uri_len),
+	void (*report_header)(void *p, const char *name, size_t name_len,
+		const char *value, size_t value_len),
 	void (*report_header_done)(void *p),
 	void (*report_data)(void *p, size_t len, const void *data))
 {
+	const char *start = buf;
+	const char *seg = buf;
+	const char *base;
+	unsigned pos;
+
 	while (len) {
-		char ch = *buf;
 		const enum state state = hp->state;
+		char ch;
+		size_t skip;
 
-		if (state == S_DATA) {
+		if (state == S_DONE) {
+			break; /* leave the rest for the next message */
+		} else if (state == S_DATA) {
+			size_t count = len;
+
+			if ((long long)count > hp->content_length_remaining)
+				count = hp->content_length_remaining;
 			if (report_data)
-				report_data(p, len, buf);
-			Debug("DATA: len=%zd\n", len);
-			return 0;
+				report_data(p, count, buf);
+			buf += count;
+			len -= count;
+			hp->content_length_remaining -= count;
+			if (hp->content_length_remaining)
+				continue;
+			if (hp->chunked) {
+				hp->state = S_CHUNK_DATA_CR;
+				continue;
+			}
+			goto body_done;
+		} else if (state == S_REQUESTHEADER_FIELDNAME_FIRSTCHAR) {
+			skip = header_line(hp, buf, len, p, report_header);
+			if (skip) {
+				buf += skip;
+				len -= skip;
+				hp->debug_ofs += skip;
+				seg = buf;
+				continue;
+			}
+		}
+		skip = scan_token(state, buf, len);
+		if (skip) {
+			buf += skip;
+			len -= skip;
+			hp->debug_ofs += skip;
+			hp->line_len += skip;
+			if (hp->line_len > HTTPPARSER_LINE_MAX)
+				goto buffer_overflow;
+			if (!len)
+				break;
 		}
+		ch = *buf;
 		hp->debug_ofs++;
 		buf++;
 		len--;
+		pos = hp->line_len++;
+		if (pos >= HTTPPARSER_LINE_MAX)
+			goto buffer_overflow;
 		switch (state) {
 		case S_REQUESTLINE_METHOD:
 			if (ch == '\r' || ch == '\n') {
 				goto terrible_error;
 			} else if (ch == ' ') {
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), 0))
-					goto buffer_overflow;
+				hp->first_ofs = 0;
+				hp->first_len = pos;
 				hp->state = S_REQUESTLINE_URI_FIRSTCHAR;
-			} else {
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), ch))
-					goto buffer_overflow;
 			}
 			break;
 		case S_REQUESTLINE_URI_FIRSTCHAR:
 			if (ch == ' ' || ch == '\r' || ch == '\n')
 				goto terrible_error;
-			hp->second_tok = hp->cur_tok;
-			if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), ch))
-				goto buffer_overflow;
+			hp->second_ofs = pos;
 			hp->state = S_REQUESTLINE_URI;
 			break;
 		case S_REQUESTLINE_URI:
-			if (ch == ' ') {
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), 0))
+			if (ch == ' ' || ch == '\r') {
+				hp->second_len = pos - hp->second_ofs;
+				base = line_base(hp, &seg, buf - 1);
+				if (!base)
 					goto buffer_overflow;
 				if (report_method)
-					report_method(p, hp->tok, hp->tok + hp->second_tok);
-				tok_rewind(&hp->cur_tok);
-				hp->state = S_REQUESTLINE_HTTPVERSION;
-			} else if (ch == '\r') {
-				/* TODO: use HTTP/1.0 mode */
-				hp->state = S_REQUESTLINE_END;
+					report_method(p, base + hp->first_ofs,
+						hp->first_len,
+						base + hp->second_ofs,
+						hp->second_len);
+				/* without a version, use HTTP/1.0 mode */
+				if (ch == ' ')
+					hp->state = S_REQUESTLINE_HTTPVERSION;
+				else
+					hp->state = S_REQUESTLINE_END;
+				hp->second_ofs = pos + 1;
 			} else if (ch == '\n') {
 				goto terrible_error;
-			} else {
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), ch))
-					goto buffer_overflow;
-				hp->state = S_REQUESTLINE_URI;
 			}
 			break;
 		case S_REQUESTLINE_HTTPVERSION:
-			// TODO: support parsing this
-			if (ch == '\r')
+			if (ch == '\r') {
+				base = line_base(hp, &seg, buf - 1);
+				if (!base)
+					goto buffer_overflow;
+				if (process_version(hp, base + hp->second_ofs,
+					pos - hp->second_ofs))
+					goto terrible_error;
 				hp->state = S_REQUESTLINE_END;
+			} else if (ch == '\n') {
+				goto terrible_error;
+			}
 			break;
 		case S_REQUESTLINE_END:
 			if (ch != '\n')
 				goto terrible_error;
+			line_next(hp, &seg, buf);
 			hp->state = S_REQUESTHEADER_FIELDNAME_FIRSTCHAR;
 			break;
 		case S_REQUESTHEADER_FIELDNAME_FIRSTCHAR:
@@ -140,9 +461,7 @@ int httpparser(struct httpparser *hp, const char *buf, size_t len, void *p,
 			} else if (ch == '\n' || ch == ':') {
 				goto terrible_error;
 			} else {
-				tok_rewind(&hp->cur_tok);
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), ch))
-					goto buffer_overflow;
+				hp->first_ofs = pos;
 				hp->state = S_REQUESTHEADER_FIELDNAME;
 			}
 			break;
@@ -150,70 +469,227 @@ int httpparser(struct httpparser *hp, const char *buf, size_t len, void *p,
 			if (ch == '\r' || ch == '\n') {
 				goto terrible_error;
 			} else if (ch == ':') {
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), 0))
-					goto buffer_overflow;
+				hp->first_len = pos - hp->first_ofs;
 				hp->state = S_REQUESTHEADER_FIELDVALUE_FIRSTCHAR;
-			} else {
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), ch))
-					goto buffer_overflow;
 			}
 			break;
 		case S_REQUESTHEADER_FIELDVALUE_FIRSTCHAR:
 			if (ch == '\r') {
 				/* empty header */
-				if (report_header)
-					report_header(p, hp->tok, "");
+				hp->second_ofs = pos;
+				goto header_value;
 			} else if (ch == '\n') {
 				goto terrible_error;
-			} else if (isspace(ch)) {
-				/* ignore linear white space */
-			} else {
-				hp->second_tok = hp->cur_tok;
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), ch))
-					goto buffer_overflow;
+			} else if (!isspace(ch)) {
+				/* linear white space is skipped */
+				hp->second_ofs = pos;
 				hp->state = S_REQUESTHEADER_FIELDVALUE;
 			}
 			break;
 		case S_REQUESTHEADER_FIELDVALUE:
 			if (ch == '\r') {
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), 0))
+header_value:
+				hp->second_len = pos - hp->second_ofs;
+				base = line_base(hp, &seg, buf - 1);
+				if (!base)
 					goto buffer_overflow;
-				if (process_header(hp, hp->tok, hp->tok + hp->second_tok))
+				if (process_header(hp, base + hp->first_ofs,
+					hp->first_len, base + hp->second_ofs,
+					hp->second_len))
 					goto terrible_error;
 				if (report_header)
-					report_header(p, hp->tok, hp->tok + hp->second_tok);
+					report_header(p, base + hp->first_ofs,
+						hp->first_len,
+						base + hp->second_ofs,
+						hp->second_len);
 				hp->state = S_REQUESTHEADER_EOL;
 			} else if (ch == '\n') {
 				goto terrible_error;
-			} else {
-				if (tok_add(hp->tok, &hp->cur_tok, sizeof(hp->tok), ch))
-					goto buffer_overflow;
 			}
 			break;
 		case S_REQUESTHEADER_EOL:
 			if (ch != '\n')
 				goto terrible_error;
-			else
-				hp->state = S_REQUESTHEADER_FIELDNAME_FIRSTCHAR;
+			line_next(hp, &seg, buf);
+			hp->state = S_REQUESTHEADER_FIELDNAME_FIRSTCHAR;
 			break;
 		case S_REQUESTHEADER_BLANKLINE:
 			if (ch != '\n')
 				goto terrible_error;
+			line_next(hp, &seg, buf);
+			/* a length and chunked framing disagree about where
+			 * the body ends, a classic smuggling attempt */
+			if (hp->chunked && hp->content_length_remaining >= 0)
+				goto terrible_error;
 			if (report_header_done)
 				report_header_done(p);
-			hp->state = S_DATA;
+			if (hp->chunked) {
+				hp->content_length_remaining = 0;
+				hp->state = S_CHUNK_SIZE;
+			} else if (hp->content_length_remaining > 0) {
+				hp->state = S_DATA;
+			} else {
+				hp->state = S_DONE;
+				hp->done = 1;
+			}
+			break;
+		case S_CHUNK_SIZE:
+			if (hexdigit(ch) >= 0) {
+				/* 15 digits can't overflow */
+				if (pos >= 15)
+					goto terrible_error;
+				hp->content_length_remaining =
+					hp->content_length_remaining * 16 +
+					hexdigit(ch);
+				break;
+			}
+			if (!pos)
+				goto terrible_error;
+			if (ch == '\r')
+				hp->state = S_CHUNK_SIZE_LF;
+			else if (ch == ';' || ch == ' ' || ch == '\t')
+				hp->state = S_CHUNK_EXT;
+			else
+				goto terrible_error;
+			break;
+		case S_CHUNK_EXT:
+			/* extensions are ignored */
+			if (ch == '\r')
+				hp->state = S_CHUNK_SIZE_LF;
+			else if (ch == '\n')
+				goto terrible_error;
+			break;
+		case S_CHUNK_SIZE_LF:
+			if (ch != '\n')
+				goto terrible_error;
+			line_next(hp, &seg, buf);
+			if (hp->content_length_remaining)
+				hp->state = S_DATA;
+			else
+				hp->state = S_TRAILER_FIRSTCHAR;
+			break;
+		case S_CHUNK_DATA_CR:
+			if (ch != '\r')
+				goto terrible_error;
+			hp->state = S_CHUNK_DATA_LF;
 			break;
+		case S_CHUNK_DATA_LF:
+			if (ch != '\n')
+				goto terrible_error;
+			line_next(hp, &seg, buf);
+			hp->state = S_CHUNK_SIZE;
+			break;
+		case S_TRAILER_FIRSTCHAR:
+			/* trailer fields are ignored */
+			if (ch == '\r')
+				hp->state = S_TRAILER_END_LF;
+			else if (ch == '\n')
+				goto terrible_error;
+			else
+				hp->state = S_TRAILER;
+			break;
+		case S_TRAILER:
+			if (ch == '\n') {
+				line_next(hp, &seg, buf);
+				hp->state = S_TRAILER_FIRSTCHAR;
+			}
+			break;
+		case S_TRAILER_END_LF:
+			if (ch != '\n')
+				goto terrible_error;
+			line_next(hp, &seg, buf);
+			goto body_done;
+		case S_DATA:
+		case S_DONE:
+			break; /* handled above */
 		}
+		continue;
+body_done:
+		/* a zero length report marks the end of the body */
+		if (report_data)
+			report_data(p, 0, NULL);
+		hp->state = S_DONE;
+		hp->done = 1;
 	}
-	return 0;
+	/* the line continues in the next buffer, keep what we have of it. the
+	 * framing lines of a chunked body are not reported, so not kept. */
+	if (hp->line_len && buf > seg && hp->state < S_DATA &&
+		tok_append(hp, seg, buf - seg))
+		goto buffer_overflow;
+	return buf - start;
 terrible_error:
 	Error("some terrible error occured (cur=%d)\n", hp->debug_ofs);
 	return -1;
 buffer_overflow:
 	Error("buffer overflow (cur=%d)\n", hp->debug_ofs);
-	Debug("\"%.*s\"\n", hp->cur_tok, hp->tok);
-	if (hp->second_tok < hp->cur_tok)
-		Debug("\"%.*s\"\n", hp->cur_tok - hp->second_tok,
-			hp->tok + hp->second_tok);
 	return -1;
 }
+
+/* adapts httpparser_span() to callers that want terminated strings */
+struct legacy {
+	void *p;
+	void (*report_method)(void *p, const char *method, const char *uri);
+	void (*report_header)(void *p, const char *name, const char *value);
+	void (*report_header_done)(void *p);
+	void (*report_data)(void *p, size_t len, const void *data);
+};
+
+static void legacy_pair(void *p, const char *a, size_t a_len,
+	const char *b, size_t b_len, int method)
+{
+	struct legacy *l = p;
+	char tmp[HTTPPARSER_LINE_MAX + 2];
+
+	memcpy(tmp, a, a_len);
+	tmp[a_len] = 0;
+	memcpy(tmp + a_len + 1, b, b_len);
+	tmp[a_len + 1 + b_len] = 0;
+	if (method)
+		l->report_method(l->p, tmp, tmp + a_len + 1);
+	else
+		l->report_header(l->p, tmp, tmp + a_len + 1);
+}
+
+static void legacy_method(void *p, const char *method, size_t method_len,
+	const char *uri, size_t uri_len)
+{
+	legacy_pair(p, method, method_len, uri, uri_len, 1);
+}
+
+static void legacy_header(void *p, const char *name, size_t name_len,
+	const char *value, size_t value_len)
+{
+	legacy_pair(p, name, name_len, value, value_len, 0);
+}
+
+static void legacy_header_done(void *p)
+{
+	struct legacy *l = p;
+
+	l->report_header_done(l->p);
+}
+
+static void legacy_data(void *p, size_t len, const void *data)
+{
+	struct legacy *l = p;
+
+	l->report_data(l->p, len, data);
+}
+
+int httpparser(struct httpparser *hp, const char *buf, size_t len, void *p,
+	void (*report_method)(void *p, const char *method, const char *uri),
+	void (*report_header)(void *p, const char *name, const char *value),
+	void (*report_header_done)(void *p),
+	void (*report_data)(void *p, size_t len, const void *data))
+{
+	struct legacy l = {
+		p, report_method, report_header, report_header_done,
+		report_data,
+	};
+
+	return httpparser_span(hp, buf, len, &l,
+		report_method ? legacy_method : NULL,
+		report_header ? legacy_header : NULL,
+		report_header_done ? legacy_header_done : NULL,
+		report_data ? legacy_data : NULL);
+}
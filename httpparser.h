@@ -17,26 +17,71 @@
 #define HTTPPARSER_H
 #include <stddef.h>
 
+#define HTTPPARSER_LINE_MAX 4096 /* longest request or header line */
+
+/* tokens are reported as spans into the caller's buffer. a line that is
+ * split across two calls is copied to tok until it is complete. */
 struct httpparser {
 	int state;
+	int done; /* a complete message was parsed */
+	unsigned line_len; /* bytes of the current line seen so far */
+	unsigned first_ofs, first_len; /* method or header name */
+	unsigned second_ofs, second_len; /* URI or header value */
+	unsigned debug_ofs;
+	long long content_length_remaining; /* or the current chunk's */
+	int chunked; /* Transfer-Encoding: chunked */
+	unsigned char http_major, http_minor;
+	char *tok;
 	unsigned cur_tok;
 	unsigned max_tok;
-	unsigned debug_ofs;
-	unsigned second_tok;
-	long long content_length_remaining;
-	char tok[4096];
 };
 
+/* must not be called while a line is pending, see httpparser_free(). */
 static inline void httpparser_init(struct httpparser *hp)
 {
 	hp->state = 0; /* S_REQUESTLINE_METHOD; */
-	hp->second_tok = 0;
+	hp->done = 0;
+	hp->line_len = 0;
+	hp->first_ofs = hp->first_len = 0;
+	hp->second_ofs = hp->second_len = 0;
+	hp->tok = NULL;
 	hp->cur_tok = 0;
-	hp->max_tok = sizeof(hp->tok);
+	hp->max_tok = 0;
 	hp->debug_ofs = 0;
 	hp->content_length_remaining = -1;
+	hp->chunked = 0;
+	hp->http_major = 1; /* requests without a version are HTTP/1.0 */
+	hp->http_minor = 0;
+}
+
+void httpparser_free(struct httpparser *hp);
+
+/* nothing of the next message has arrived */
+static inline int httpparser_idle(const struct httpparser *hp)
+{
+	return hp->state == 0 && hp->line_len == 0;
 }
 
+/* valid once the headers are done */
+static inline int httpparser_has_body(const struct httpparser *hp)
+{
+	return hp->chunked || hp->content_length_remaining > 0;
+}
+
+/* returns the number of bytes consumed, or -1 on error. stops at the end of
+ * a message, httpparser_init() must be called before parsing the next one.
+ * spans are only valid until the callback returns. a body is reported in
+ * pieces as it arrives, then once with a length of 0 when it is complete. */
+int httpparser_span(struct httpparser *hp, const char *buf, size_t len,
+	void *p,
+	void (*report_method)(void *p, const char *method, size_t method_len,
+		const char *uri, size_t uri_len),
+	void (*report_header)(void *p, const char *name, size_t name_len,
+		const char *value, size_t value_len),
+	void (*report_header_done)(void *p),
+	void (*report_data)(void *p, size_t len, const void *data));
+
+/* same as httpparser_span(), with tokens copied to terminated strings. */
 int httpparser(struct httpparser *hp, const char *buf, size_t len, void *p,
 	void (*report_method)(void *p, const char *method, const char *uri),
 	void (*report_header)(void *p, const char *name, const char *value),
@@ -47,6 +47,7 @@ static struct data *mod_start(const char *method, const char *uri,
 {
 	struct mod_counter_info *info;
 
+	(void)method;
 	info = calloc(1, sizeof(*info));
 	if (!info) {
 		perror(uri);
@@ -63,32 +64,29 @@ static struct data *mod_start(const char *method, const char *uri,
 static void on_header_done(struct channel *ch, struct data *app_data,
 	struct env *headers)
 {
-	struct mod_counter_info *info = container_of(app_data,
-		struct mod_counter_info, app_data);
-	char length_str[20];
+	static const char header[] = "Content-Type: text/plain\r\n";
 	char buf[256]; /* TODO: use a bigger buffer size */
-	size_t buf_len;
-
-	httpd_response(ch, 200);
-
-	httpd_header(ch, "Content-Type", "text/plain");
+	struct module_seg segs[2] = {
+		{ .type = MODULE_SEG_HEADER, .data = header,
+			.len = sizeof(header) - 1 },
+		{ .type = MODULE_SEG_MEM, .data = buf },
+	};
+
+	(void)app_data;
+	(void)headers;
 	snprintf(buf, sizeof(buf), "%lu\r\n", counter++);
-	buf_len = strlen(buf);
-
-	snprintf(length_str, sizeof(length_str), "%lu", (unsigned long)buf_len);
-	httpd_header(ch, "Content-Length", length_str);
-
-	httpd_end_headers(ch);
-
-	ch_write(ch, buf, buf_len);
+	segs[1].len = strlen(buf);
 
-	/* TODO: support persistent */
-	ch_done(ch);
+	httpd_respond(ch, 200, segs, 2);
 }
 
 static void on_data(struct channel *ch, struct data *app_data, size_t len,
 	const void *data)
 {
+	(void)ch;
+	(void)app_data;
+	(void)len;
+	(void)data;
 }
 
 const struct module mod_counter = {
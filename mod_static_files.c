@@ -19,23 +19,18 @@
 #include <errno.h>
 
 #include <limits.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
 
 #include "logger.h"
 #include "container_of.h"
 #include "httpd.h"
 #include "module.h"
-#include "ext.h"
+#include "util.h"
+#include "filecache.h"
 #include "mod_static_files.h"
 
 struct mod_static_file_info {
 	struct data app_data;
-	int fd;
-	struct stat stat_buf;
-	const char *content_type;
+	struct filecache_entry *file;
 	const char *base;
 	const char *uri;
 };
@@ -47,14 +42,13 @@ static void mod_free(struct data *app_data)
 
 	Debug("free %p (info=%p)\n", app_data, info);
 	assert(app_data != NULL);
-	close(info->fd);
+	filecache_release(info->file);
 	free(info);
 }
 
 static int open_path(struct mod_static_file_info *info,
 	const char *base, const char *uri)
 {
-	int fd;
 	char path[PATH_MAX];
 	int e;
 	size_t base_len = strlen(base);
@@ -82,19 +76,8 @@ static int open_path(struct mod_static_file_info *info,
 
 	Debug("Using path=\"%s\" (%s/%s)\n", path, base, uri);
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0)
-		goto failure;
-	if (fstat(fd, &info->stat_buf))
-		goto close_and_fail;
-	info->fd = fd;
-	info->content_type = ext_content_type(uri);
-	return 0;
-close_and_fail:
-	close(fd);
-failure:
-	Error("%s:%s\n", path, strerror(errno));
-	return -1;
+	info->file = filecache_open(path);
+	return info->file ? 0 : -1;
 }
 
 static struct data *mod_start(const char *method, const char *uri,
@@ -102,12 +85,12 @@ static struct data *mod_start(const char *method, const char *uri,
 {
 	struct mod_static_file_info *info;
 
+	(void)method;
 	info = calloc(1, sizeof(*info));
 	if (!info) {
 		perror(uri);
 		return NULL;
 	}
-	info->fd = -1;
 	info->app_data.free_data = mod_free;
 	info->uri = uri;
 	info->base = arg; /* TODO: parse multiple options in arg */
@@ -121,54 +104,39 @@ static void on_header_done(struct channel *ch, struct data *app_data,
 {
 	struct mod_static_file_info *info = container_of(app_data,
 		struct mod_static_file_info, app_data);
-	char length_str[20];
-	char buf[256]; /* TODO: use a bigger buffer size */
-	off_t total_sent;
 
+	struct module_seg segs[2] = {
+		{ .type = MODULE_SEG_HEADER },
+	};
+
+	(void)headers;
 	if (open_path(info, info->base, info->uri)) {
-		httpd_response(ch, 404);
-		httpd_end_headers(ch);
-		ch_done(ch);
+		httpd_respond(ch, 404, NULL, 0);
 		return;
 	}
 
-	httpd_response(ch, 200);
-
-	if (info->content_type)
-		httpd_header(ch, "Content-Type", info->content_type);
-	else
-		httpd_header(ch, "Content-Type", "text/plain");
-
-	snprintf(length_str, sizeof(length_str), "%lu",
-		(long)info->stat_buf.st_size);
-	httpd_header(ch, "Content-Length", length_str);
-
-	httpd_end_headers(ch);
-
-	/* stream file out */
-	total_sent = 0;
-	while (total_sent < info->stat_buf.st_size) {
-		ssize_t res;
-
-		res = read(info->fd, buf, sizeof(buf));
-		if (res < 0) {
-			perror(__func__);
-			ch_done(ch);
-			return;
-		}
-		if (total_sent + res > info->stat_buf.st_size)
-			res = info->stat_buf.st_size - total_sent;
-		ch_write(ch, buf, res);
-		total_sent += res;
+	segs[0].data = info->file->header;
+	segs[0].len = info->file->header_len;
+	if (info->file->data) {
+		/* resident, the body joins the headers in the same writev */
+		segs[1].type = MODULE_SEG_MEM;
+		segs[1].data = info->file->data;
+	} else {
+		/* the headers are flushed, then the kernel sends the file */
+		segs[1].type = MODULE_SEG_FILE;
+		segs[1].fd = info->file->fd;
 	}
-
-	/* TODO: support persistent */
-	ch_done(ch);
+	segs[1].len = info->file->st.st_size;
+	httpd_respond(ch, 200, segs, 2);
 }
 
 static void on_data(struct channel *ch, struct data *app_data, size_t len,
 	const void *data)
 {
+	(void)ch;
+	(void)app_data;
+	(void)len;
+	(void)data;
 }
 
 const struct module mod_static_files = {
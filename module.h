@@ -16,6 +16,7 @@
 #ifndef MODULE_H
 #define MODULE_H
 #include <stddef.h>
+#include <sys/types.h>
 #include "channel.h"
 #include "env.h"
 #include "data.h"
@@ -26,10 +27,32 @@ struct module {
 		const char *arg);
 	void (*on_header_done)(struct channel *ch, struct data *app_data,
 		struct env *headers);
+	/* the request body in pieces as it arrives, then len 0 at its end */
 	void (*on_data)(struct channel *ch, struct data *app_data, size_t len,
 		const void *data);
 };
 
+/* a piece of a response handed to httpd_respond(). the core picks how
+ * it goes out: header blocks and memory are gathered for writev(), file
+ * ranges go out with sendfile(). Content-Length comes from the body
+ * segments, header blocks must not carry it. */
+enum module_seg_type {
+	MODULE_SEG_HEADER, /* preformatted header lines, each ending in CRLF */
+	MODULE_SEG_MEM, /* body bytes */
+	MODULE_SEG_FILE, /* body bytes from a range of an open file */
+};
+
+struct module_seg {
+	enum module_seg_type type;
+	const void *data; /* HEADER and MEM */
+	int fd; /* FILE, only used with positional I/O */
+	off_t offset;
+	size_t len;
+	/* called once the segment is no longer needed, sent or not */
+	void (*release)(void *arg);
+	void *arg;
+};
+
 const struct module *module_find(const char *modname);
 int module_register(const char *modname, const struct module *module);
 struct data *module_start(const struct module *module, const char *method,
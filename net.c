@@ -14,28 +14,206 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <sys/time.h>
 #include "logger.h"
 #include "net.h"
 
-static void make_name(char *buf, size_t buflen,
+/* listening sockets handed down by the previous process, fd is -1 once
+ * adopted. index is the place in its listen group, or -1 for any. */
+static struct inherited {
+	int fd;
+	int index;
+} *inherited;
+static unsigned num_inherited;
+
+/* returns -1 if the address could not be converted or did not fit. */
+static int make_name(char *buf, size_t buflen,
 	const struct sockaddr *sa, socklen_t salen)
 {
 	char hostbuf[64], servbuf[32];
+	int len;
+
+	if (getnameinfo(sa, salen, hostbuf, sizeof(hostbuf), servbuf,
+		sizeof(servbuf), NI_NUMERICHOST | NI_NUMERICSERV)) {
+		snprintf(buf, buflen, "?");
+		return -1;
+	}
+	len = snprintf(buf, buflen, "%s:%s", hostbuf, servbuf);
+	return len < 0 || (size_t)len >= buflen ? -1 : 0;
+}
+
+/* attach a classic BPF program to a SO_REUSEPORT group that selects the
+ * socket with the same index as the CPU that received the packet. */
+static int attach_cpu_steering(int fd, unsigned count)
+{
+	struct sock_filter code[] = {
+		/* A = raw_smp_processor_id() */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		/* A = A % count */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, count },
+		/* return A */
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(*code),
+		.filter = code,
+	};
 
-	getnameinfo(sa, salen, hostbuf, sizeof(hostbuf), servbuf,
-		sizeof(servbuf), NI_NUMERICHOST | NI_NUMERICSERV);
-	snprintf(buf, buflen, "%s:%s", hostbuf, servbuf);
-	// TODO: return a value
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		&prog, sizeof(prog));
+}
+
+static int listen_socket(const struct addrinfo *cur, unsigned flags,
+	const char *node, const char *service)
+{
+	int fd;
+	const int yes = 1;
+
+	fd = socket(cur->ai_family, cur->ai_socktype | SOCK_CLOEXEC,
+		cur->ai_protocol);
+	if (fd < 0) {
+		Error("socket():%s (%s:%s)\n", strerror(errno),
+			node, service);
+		return -1;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))) {
+		Error("SO_REUSEADDR:%s (%s:%s)\n", strerror(errno),
+			node, service);
+		goto fail;
+	}
+	if ((flags & NET_REUSEPORT) &&
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))) {
+		Error("SO_REUSEPORT:%s (%s:%s)\n", strerror(errno),
+			node, service);
+		goto fail;
+	}
+	/* keep v6 sockets from claiming the v4 port as well */
+	if (cur->ai_family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6,
+		IPV6_V6ONLY, &yes, sizeof(yes))) {
+		Error("IPV6_V6ONLY:%s (%s:%s)\n", strerror(errno),
+			node, service);
+		goto fail;
+	}
+	if (bind(fd, cur->ai_addr, cur->ai_addrlen)) {
+		Error("bind():%s (%s:%s)\n", strerror(errno),
+			node, service);
+		goto fail;
+	}
+	if (listen(fd, SOMAXCONN)) {
+		Error("listen():%s (%s:%s)\n", strerror(errno),
+			node, service);
+		goto fail;
+	}
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+/* an inherited listener bound to the same address and at the same place
+ * in its listen group, or -1 */
+static int inherited_socket(const struct addrinfo *cur, unsigned index)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	unsigned i;
+	int fd, listening;
+	socklen_t optlen;
+
+	for (i = 0; i < num_inherited; i++) {
+		fd = inherited[i].fd;
+		if (fd < 0 || (inherited[i].index >= 0 &&
+			(unsigned)inherited[i].index != index))
+			continue;
+		addrlen = sizeof(addr);
+		optlen = sizeof(listening);
+		if (getsockname(fd, (struct sockaddr*)&addr, &addrlen) ||
+			addrlen != cur->ai_addrlen ||
+			memcmp(&addr, cur->ai_addr, addrlen))
+			continue;
+		if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN,
+			&listening, &optlen) || !listening)
+			continue;
+		inherited[i].fd = -1;
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		return fd;
+	}
+	return -1;
+}
+
+/* take over listeners left open across exec(), a comma separated list of
+ * descriptors, each optionally followed by ":" and its index in a listen
+ * group. net_listen() uses them instead of binding new sockets. */
+int net_inherit(const char *list)
+{
+	struct inherited *p;
+	const char *start;
+	char *end;
+	long fd, index;
+
+	while (list && *list) {
+		fd = strtol(list, &end, 10);
+		if (end == list || fd < 0)
+			goto bad_list;
+		index = -1;
+		if (*end == ':') {
+			start = end + 1;
+			index = strtol(start, &end, 10);
+			if (end == start || index < 0)
+				goto bad_list;
+		}
+		p = realloc(inherited, (num_inherited + 1) * sizeof(*p));
+		if (!p) {
+			SysError();
+			return -1;
+		}
+		inherited = p;
+		inherited[num_inherited].fd = fd;
+		inherited[num_inherited].index = index;
+		num_inherited++;
+		list = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+bad_list:
+	Error("bad descriptor list \"%s\"\n", list);
+	return -1;
+}
+
+/* close the inherited listeners that no address asked for */
+void net_inherit_close(void)
+{
+	unsigned i;
+
+	for (i = 0; i < num_inherited; i++)
+		if (inherited[i].fd >= 0) {
+			Info("closing unused inherited listener %d\n",
+				inherited[i].fd);
+			close(inherited[i].fd);
+		}
+	free(inherited);
+	inherited = NULL;
+	num_inherited = 0;
 }
 
 int net_listen(void (*create_server)(void *p, struct net_listen sock,
 	size_t desc_len, const char *desc), void *p,
 	const char *node, const char *service)
+{
+	return net_listen_group(create_server, p, node, service, 1, 0);
+}
+
+int net_listen_group(void (*create_server)(void *p, struct net_listen sock,
+	size_t desc_len, const char *desc), void *p,
+	const char *node, const char *service, unsigned count, unsigned flags)
 {
 	struct addrinfo hints = {
 		.ai_flags = AI_PASSIVE,
@@ -53,6 +231,10 @@ int net_listen(void (*create_server)(void *p, struct net_listen sock,
 		Error("create_server callback is NULL.\n");
 		return -1;
 	}
+	if (count > 1 && !(flags & NET_REUSEPORT)) {
+		Error("listen group of %u requires NET_REUSEPORT\n", count);
+		return -1;
+	}
 	Debug("listen (%s:%s)\n", node, service);
 	e = getaddrinfo(node, service, &hints, &res);
 	if (e) {
@@ -61,42 +243,31 @@ int net_listen(void (*create_server)(void *p, struct net_listen sock,
 	}
 	Debug("res=%p\n", res);
 	for (cur = res; cur; cur = cur->ai_next) {
-		int fd;
-		const int yes = 1;
+		unsigned i;
 
 		make_name(desc, sizeof(desc),
 			cur->ai_addr, cur->ai_addrlen);
 		Debug("cur=%p (name=%s family=%d socktype=%d proto=%d flags=%x addrlen=%ld)\n",
 			cur, desc, cur->ai_family, cur->ai_socktype, cur->ai_protocol,
 			cur->ai_flags, (long)cur->ai_addrlen);
-		fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
-		if (fd < 0) {
-			Error("socket():%s (%s:%s)\n", strerror(errno),
-				node, service);
-			goto fail_and_free;
-		}
-		fcntl(fd, F_SETFD, FD_CLOEXEC); /* this is a race */
-		e = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-		if (e) {
-			Error("SO_REUSEADDR:%s (%s:%s)\n", strerror(errno),
-				node, service);
-			goto fail_and_free;
-		}
-		e = bind(fd, cur->ai_addr, cur->ai_addrlen);
-		if (e) {
-			Error("bind():%s (%s:%s)\n", strerror(errno),
-				node, service);
-			goto fail_and_free;
+		for (i = 0; i < count; i++) {
+			sock.fd = inherited_socket(cur, i);
+			if (sock.fd >= 0)
+				Info("adopted inherited listener %s\n", desc);
+			else
+				sock.fd = listen_socket(cur, flags, node,
+					service);
+			if (sock.fd < 0)
+				goto fail_and_free;
+			/* the program applies to the whole group */
+			if (i == 0 && (flags & NET_CPU_STEERING) &&
+				attach_cpu_steering(sock.fd, count))
+				Warning("SO_ATTACH_REUSEPORT_CBPF:%s (%s)\n",
+					strerror(errno), desc);
+			Debug("create server... %s (%u of %u)\n",
+				desc, i + 1, count);
+			create_server(p, sock, strlen(desc), desc);
 		}
-		e = listen(fd, SOMAXCONN);
-		if (e) {
-			Error("listen():%s (%s:%s)\n", strerror(errno),
-				node, service);
-			goto fail_and_free;
-		}
-		sock.fd = fd;
-		Debug("create server... %s\n", desc);
-		create_server(p, sock, strlen(desc), desc);
 	}
 	freeaddrinfo(res);
 	return 0;
@@ -105,27 +276,123 @@ fail_and_free:
 	return -1;
 }
 
+static int accept_socket(int fd, struct net_socket *socket, unsigned flags)
+{
+	int type = SOCK_CLOEXEC;
+
+	if (flags & NET_NONBLOCK)
+		type |= SOCK_NONBLOCK;
+	socket->addrlen = sizeof(socket->addr);
+	socket->fd = accept4(fd, (struct sockaddr*)&socket->addr,
+		&socket->addrlen, type);
+	if (socket->fd < 0) {
+		/* non-blocking listeners run dry, signals interrupt the
+		 * wait and descriptors run out, the caller decides whether
+		 * to try again */
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			errno != EINTR && errno != EMFILE && errno != ENFILE)
+			perror("accept4()");
+		return -1;
+	}
+	return 0;
+}
+
 int net_accept(struct net_listen *listen_handle, struct net_socket *socket,
 	size_t desc_len, char *desc)
 {
-	struct sockaddr_storage addr;
-	socklen_t addrlen = sizeof(addr);
-	int newfd;
+	if (accept_socket(listen_handle->fd, socket, 0))
+		return -1;
+	if (desc)
+		net_socket_name(socket, desc, desc_len);
+	return 0;
+}
+
+/* take up to max connections from a non-blocking listener, stopping early
+ * once it runs dry. returns the number taken, errno says why when it is
+ * less than max. */
+unsigned net_accept_batch(struct net_listen *listen_handle,
+	struct net_socket *sockets, unsigned max, unsigned flags)
+{
+	unsigned n;
+
+	for (n = 0; n < max; n++)
+		if (accept_socket(listen_handle->fd, &sockets[n], flags))
+			break;
+	return n;
+}
 
+/* the peer as "address:port". accepting only stores the binary address,
+ * this is for the connections someone actually logs. */
+const char *net_socket_name(const struct net_socket *socket, char *buf,
+	size_t buflen)
+{
+	const struct sockaddr_in *sin = (const void*)&socket->addr;
+	const struct sockaddr_in6 *sin6 = (const void*)&socket->addr;
+	char port[8], *p = port + sizeof(port);
+	const void *addr;
+	unsigned n;
+	size_t len;
+
+	switch (socket->addr.ss_family) {
+	case AF_INET:
+		addr = &sin->sin_addr;
+		n = ntohs(sin->sin_port);
+		break;
+	case AF_INET6:
+		addr = &sin6->sin6_addr;
+		n = ntohs(sin6->sin6_port);
+		break;
+	default:
+		addr = NULL;
+	}
+	if (!addr || !inet_ntop(socket->addr.ss_family, addr, buf, buflen)) {
+		make_name(buf, buflen, (const struct sockaddr*)&socket->addr,
+			socket->addrlen);
+		return buf;
+	}
+	*--p = 0;
 	do {
-		newfd = accept(listen_handle->fd,
-			(struct sockaddr*)&addr, &addrlen);
-		pthread_testcancel();
-	} while (newfd < 0 && errno == EINTR);
-	if (newfd < 0) {
-		perror("accept()");
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	*--p = ':';
+	len = strlen(buf);
+	n = port + sizeof(port) - p;
+	if (len + n <= buflen)
+		memcpy(buf + len, p, n);
+	return buf;
+}
+
+static int set_nonblock(int fd)
+{
+	int fl;
+
+	fl = fcntl(fd, F_GETFL);
+	if (fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK)) {
+		SysError();
 		return -1;
 	}
-	fcntl(newfd, F_SETFD, FD_CLOEXEC); /* a race, but better than nothing */
-
-	if (desc)
-		make_name(desc, desc_len, (struct sockaddr*)&addr, addrlen);
-	socket->fd = newfd;
 	return 0;
 }
 
+int net_listen_nonblock(struct net_listen *listen_handle)
+{
+	return set_nonblock(listen_handle->fd);
+}
+
+int net_socket_nonblock(struct net_socket *socket)
+{
+	return set_nonblock(socket->fd);
+}
+
+/* limit how long a blocking read may wait. 0 waits forever. */
+int net_socket_timeout(struct net_socket *socket, unsigned seconds)
+{
+	struct timeval tv = { .tv_sec = seconds, .tv_usec = 0 };
+
+	if (setsockopt(socket->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+		SysError();
+		return -1;
+	}
+	return 0;
+}
@@ -15,6 +15,13 @@
  */
 #ifndef NET_H
 #define NET_H
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define NET_REUSEPORT 1 /* bind several sockets to one address */
+#define NET_CPU_STEERING 2 /* kernel picks the socket by receiving CPU */
+#define NET_NONBLOCK 4 /* accepted sockets start non-blocking */
+#define NET_NAME_MAX 64 /* room for any "address:port" */
 
 struct net_listen {
 	int fd;
@@ -22,11 +29,26 @@ struct net_listen {
 
 struct net_socket {
 	int fd;
+	socklen_t addrlen;
+	struct sockaddr_storage addr; /* the peer, see net_socket_name() */
 };
 
 int net_listen(void (*create_server)(void *p, struct net_listen sock,
 	size_t desc_len, const char *desc), void *p,
 	const char *node, const char *service);
+/* create_server is called count times for each address, in group order */
+int net_listen_group(void (*create_server)(void *p, struct net_listen sock,
+	size_t desc_len, const char *desc), void *p,
+	const char *node, const char *service, unsigned count, unsigned flags);
+int net_inherit(const char *list);
+void net_inherit_close(void);
 int net_accept(struct net_listen *listen_handle, struct net_socket *socket,
 	size_t desc_len, char *desc);
+unsigned net_accept_batch(struct net_listen *listen_handle,
+	struct net_socket *sockets, unsigned max, unsigned flags);
+const char *net_socket_name(const struct net_socket *socket, char *buf,
+	size_t buflen);
+int net_listen_nonblock(struct net_listen *listen_handle);
+int net_socket_nonblock(struct net_socket *socket);
+int net_socket_timeout(struct net_socket *socket, unsigned seconds);
 #endif
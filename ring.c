@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/* Dmitry Vyukov's bounded MPMC queue. every cell carries a sequence number
+ * that tells a producer or a consumer whether it is its turn for that cell,
+ * so claiming one is a single compare-and-swap on the head or tail. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logger.h"
+#include "ring.h"
+
+#define RING_CACHELINE 64
+
+struct ring_cell {
+	size_t seq;
+	/* followed by elem_size bytes */
+};
+
+struct ring {
+	size_t mask;
+	size_t stride;
+	size_t elem_size;
+	char *cells;
+	/* producers and consumers each get a line to themselves */
+	size_t tail __attribute__((aligned(RING_CACHELINE)));
+	size_t head __attribute__((aligned(RING_CACHELINE)));
+};
+
+static struct ring_cell *cell(struct ring *r, size_t pos)
+{
+	return (struct ring_cell*)(r->cells + (pos & r->mask) * r->stride);
+}
+
+struct ring *ring_new(unsigned capacity, size_t elem_size)
+{
+	struct ring *r;
+	size_t n, i;
+
+	for (n = 2; n < capacity; n <<= 1)
+		;
+	if (posix_memalign((void**)&r, RING_CACHELINE, sizeof(*r))) {
+		SysError();
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->mask = n - 1;
+	r->elem_size = elem_size;
+	r->stride = (sizeof(struct ring_cell) + elem_size
+		+ sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+	r->cells = malloc(n * r->stride);
+	if (!r->cells) {
+		SysError();
+		free(r);
+		return NULL;
+	}
+	for (i = 0; i < n; i++)
+		cell(r, i)->seq = i;
+	return r;
+}
+
+void ring_free(struct ring *r)
+{
+	if (!r)
+		return;
+	free(r->cells);
+	free(r);
+}
+
+int ring_push(struct ring *r, const void *elem)
+{
+	struct ring_cell *c;
+	size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	intptr_t dif;
+
+	for (;;) {
+		c = cell(r, pos);
+		dif = (intptr_t)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE)
+			- (intptr_t)pos;
+		if (dif == 0) {
+			/* free cell, claim it. a failed CAS reloads pos. */
+			if (__atomic_compare_exchange_n(&r->tail, &pos,
+				pos + 1, 1, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return -1; /* still holds an element from a lap ago */
+		} else {
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+	memcpy(c + 1, elem, r->elem_size);
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int ring_pop(struct ring *r, void *elem)
+{
+	struct ring_cell *c;
+	size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	intptr_t dif;
+
+	for (;;) {
+		c = cell(r, pos);
+		dif = (intptr_t)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE)
+			- (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos,
+				pos + 1, 1, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return -1; /* the producer has not filled it yet */
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+	memcpy(elem, c + 1, r->elem_size);
+	/* hand the cell to the producer on the next lap */
+	__atomic_store_n(&c->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+unsigned ring_count(struct ring *r)
+{
+	size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	return tail > head ? tail - head : 0;
+}
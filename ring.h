@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef RING_H
+#define RING_H
+#include <stddef.h>
+
+/* bounded lock-free queue of fixed size elements. any number of threads
+ * may push and pop at the same time. */
+struct ring;
+
+/* capacity is rounded up to a power of two */
+struct ring *ring_new(unsigned capacity, size_t elem_size);
+void ring_free(struct ring *r);
+/* copies elem into the ring, -1 if it is full */
+int ring_push(struct ring *r, const void *elem);
+/* copies the oldest element out, -1 if it is empty */
+int ring_pop(struct ring *r, void *elem);
+/* elements waiting, only a hint while other threads are busy */
+unsigned ring_count(struct ring *r);
+#endif
@@ -15,13 +15,16 @@
  */
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "httpd.h"
 #include "daemonize.h"
 #include "service.h"
 #include "csv.h"
 #include "logger.h"
 #include "ext.h"
+#include "filecache.h"
 #include "mod_static_files.h"
 #include "mod_counter.h"
 
@@ -132,8 +135,50 @@ static void module_register_all(void)
 	module_register("counter", &mod_counter);
 }
 
+/* kill -HUP logs these, and they are logged once more on the way out */
+static void report_stats(void)
+{
+	struct filecache_stats fc;
+	struct httpd_queue_stats q;
+
+	filecache_stats(&fc);
+	Info("file cache:%lu hits %lu misses %lu evictions, %u files "
+		"%zu bytes resident\n", fc.hits, fc.misses, fc.evictions,
+		fc.entries, fc.resident_bytes);
+	httpd_queue_stats(&q);
+	Info("queue:%u waiting %lu accepted %lu shed, %u of %u workers "
+		"busy\n", q.depth, q.accepted, q.shed, q.busy, q.workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-rs] [-e <loops>] [-t <threads>] "
+		"[-a <queue>]\n"
+		"       [-m <max threads>] [-w <seconds>] [-c <files>] "
+		"[-M <MB>]\n"
+		"  -e <loops>   event loops, 0 for one per CPU (default)\n"
+		"  -t <threads> use a blocking thread pool instead\n"
+		"  -a <queue>   accept on one thread per listener, queueing\n"
+		"               up to <queue> connections for the pool\n"
+		"  -m <max>     grow the pool from -t threads up to <max>\n"
+		"  -w <seconds> time SIGTERM gives requests to finish (30)\n"
+		"  -r           one SO_REUSEPORT listener per loop or group\n"
+		"  -s           like -r, steering connections by CPU\n"
+		"               (event loops only)\n"
+		"  -c <files>   open files kept by the file cache (%u)\n"
+		"  -M <MB>      file data the cache keeps in memory (%u)\n"
+		"SIGHUP logs the cache and queue statistics.\n", prog,
+		FILECACHE_ENTRIES, FILECACHE_MEM_BUDGET >> 20);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
+	int c;
+	int loops = 0, threads = 0, queue = 0, max_threads = 0;
+	int reuseport = 0, steering = 0;
+	unsigned cache_files = FILECACHE_ENTRIES;
+	size_t cache_mem = FILECACHE_MEM_BUDGET;
 #ifdef USE_SYSLOG
 	char *prog_name;
 
@@ -143,17 +188,63 @@ int main(int argc, char *argv[])
 	openlog(prog_name, LOG_PERROR | LOG_PID, LOG_DAEMON);
 #endif
 
+	while ((c = getopt(argc, argv, "a:c:e:m:t:w:M:rs")) != -1) {
+		switch (c) {
+		case 'a':
+			queue = atoi(optarg);
+			break;
+		case 'c':
+			cache_files = atoi(optarg);
+			break;
+		case 'M':
+			cache_mem = (size_t)atoi(optarg) << 20;
+			break;
+		case 'e':
+			loops = atoi(optarg);
+			break;
+		case 'm':
+			max_threads = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'w':
+			httpd_drain_timeout(atoi(optarg));
+			break;
+		case 's':
+			steering = 1;
+			/* fall through */
+		case 'r':
+			reuseport = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
 	module_register_all();
 
 	load_services("serv.csv");
 	ext_config_load("mime.csv");
 
-	httpd_poolsize(100);
+	if (threads > 0 || max_threads > 0) {
+		httpd_poolsize(threads);
+		httpd_acceptor(queue > 0 ? queue : 0);
+		httpd_elastic(threads, max_threads > 0 ? max_threads : 0);
+	} else {
+		httpd_eventloops(loops);
+	}
+	httpd_reuseport(reuseport, steering);
+	httpd_upgrade(argv); /* SIGUSR2 runs the binary again */
+	httpd_stats_report(report_stats);
+	filecache_config(FILECACHE_REVALIDATE, cache_files, cache_mem,
+		FILECACHE_MEM_MAX_FILE);
 	if (httpd_start(NULL, "8080")) {
 		Error("Unable to start -- Terminating\n");
 		return 1;
 	}
 	httpd_loop();
+	report_stats();
 	// daemonize();
 	Info("done -- Terminating\n");
 	return 0;
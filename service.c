@@ -21,57 +21,300 @@
 #include "module.h"
 #include "logger.h"
 
+#define HOST_BUCKETS 64
+
 struct service {
 	const struct module *module;
 	char *arg;
 	// TODO: a description would be useful for debug messages
 };
 
-struct service_entry {
-	struct service_entry *next;
-	const char *host_match;
-	const char *uri_match;
+/* a route hangs off the trie node for the literal part of its URI pattern,
+ * everything up to the first wildcard. */
+struct route {
+	struct route *next; /* same node, newest first */
+	unsigned seq; /* registration order, the newest match wins */
+	int literal; /* no wildcards, so the node must match the whole URI */
+	char *uri_match;
 	struct service service;
 };
 
-static struct service_entry *service_head;
+struct route_node {
+	char *label;
+	size_t label_len;
+	struct route_node **child; /* sorted by the first byte of the label */
+	unsigned nchild;
+	struct route *routes;
+};
+
+/* all routes registered with the same host pattern */
+struct host_group {
+	struct host_group *next;
+	unsigned hash;
+	char *host_match;
+	struct route_node root;
+};
+
+static struct host_group *host_table[HOST_BUCKETS]; /* exact hosts */
+static struct host_group *host_wildcards;
+static unsigned route_seq;
 
-static int match_service(const struct service_entry *curr, const char *host, const char *uri)
+/* length of the part of a pattern that contains no wildcards */
+static size_t literal_len(const char *pattern)
 {
-	return !fnmatch(curr->host_match, host, FNM_NOESCAPE) &&
-		!fnmatch(curr->uri_match, uri, FNM_NOESCAPE);
+	return strcspn(pattern, "*?[");
 }
 
-const struct service *service_find(const char *host, const char *uri)
+/* FNV-1a */
+static unsigned hash_str(const char *s)
 {
-	struct service_entry *curr;
+	unsigned h = 2166136261u;
 
-	// TODO: make this some sort of prefix tree
-	for (curr = service_head; curr; curr = curr->next) {
-		if (match_service(curr, host, uri))
-			return &curr->service;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
 	}
+	return h;
+}
+
+static struct host_group *group_find(const char *host, unsigned hash)
+{
+	struct host_group *g;
+
+	for (g = host_table[hash % HOST_BUCKETS]; g; g = g->next)
+		if (g->hash == hash && !strcmp(g->host_match, host))
+			return g;
 	return NULL;
 }
 
+static struct host_group *group_get(const char *host_match)
+{
+	int wildcard = host_match[literal_len(host_match)] != 0;
+	unsigned hash = hash_str(host_match);
+	struct host_group *g, **head;
+
+	if (wildcard) {
+		for (g = host_wildcards; g; g = g->next)
+			if (!strcmp(g->host_match, host_match))
+				return g;
+		head = &host_wildcards;
+	} else {
+		g = group_find(host_match, hash);
+		if (g)
+			return g;
+		head = &host_table[hash % HOST_BUCKETS];
+	}
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		return NULL;
+	g->host_match = strdup(host_match);
+	if (!g->host_match) {
+		free(g);
+		return NULL;
+	}
+	g->hash = hash;
+	g->next = *head;
+	*head = g;
+	return g;
+}
+
+/* binary search of the children on the first byte of their label. sets *index
+ * to where a child starting with c belongs. */
+static struct route_node *node_child(const struct route_node *node,
+	unsigned char c, unsigned *index)
+{
+	unsigned lo = 0, hi = node->nchild;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		unsigned char k = node->child[mid]->label[0];
+
+		if (k == c) {
+			lo = mid;
+			break;
+		} else if (k < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (index)
+		*index = lo;
+	if (lo < node->nchild && (unsigned char)node->child[lo]->label[0] == c)
+		return node->child[lo];
+	return NULL;
+}
+
+static struct route_node *node_new(const char *label, size_t len)
+{
+	struct route_node *node;
+
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		return NULL;
+	node->label = strndup(label, len);
+	if (!node->label) {
+		free(node);
+		return NULL;
+	}
+	node->label_len = len;
+	return node;
+}
+
+static int node_add_child(struct route_node *node, unsigned index,
+	struct route_node *child)
+{
+	struct route_node **c;
+
+	c = realloc(node->child, (node->nchild + 1) * sizeof(*c));
+	if (!c)
+		return -1;
+	memmove(c + index + 1, c + index, (node->nchild - index) * sizeof(*c));
+	c[index] = child;
+	node->child = c;
+	node->nchild++;
+	return 0;
+}
+
+/* split a child so that an edge ends after n bytes of its label. */
+static struct route_node *node_split(struct route_node *node, unsigned index,
+	size_t n)
+{
+	struct route_node *child = node->child[index];
+	struct route_node *mid;
+	char *rest;
+
+	mid = node_new(child->label, n);
+	if (!mid)
+		return NULL;
+	rest = strdup(child->label + n);
+	if (!rest || node_add_child(mid, 0, child)) {
+		free(rest);
+		free(mid->label);
+		free(mid);
+		return NULL;
+	}
+	free(child->label);
+	child->label = rest;
+	child->label_len -= n;
+	node->child[index] = mid;
+	return mid;
+}
+
+/* find or create the node where key ends. */
+static struct route_node *node_insert(struct route_node *node,
+	const char *key, size_t len)
+{
+	while (len) {
+		struct route_node *child;
+		unsigned index;
+		size_t n;
+
+		child = node_child(node, key[0], &index);
+		if (!child) {
+			child = node_new(key, len);
+			if (!child)
+				return NULL;
+			if (node_add_child(node, index, child)) {
+				free(child->label);
+				free(child);
+				return NULL;
+			}
+			return child;
+		}
+		for (n = 1; n < child->label_len && n < len &&
+			child->label[n] == key[n]; n++)
+			;
+		if (n < child->label_len) {
+			child = node_split(node, index, n);
+			if (!child)
+				return NULL;
+		}
+		node = child;
+		key += n;
+		len -= n;
+	}
+	return node;
+}
+
+/* walk down the trie along uri. only routes on the path can match, and at
+ * each node the first one that matches is the newest there. */
+static const struct route *node_lookup(const struct route_node *node,
+	const char *uri, const struct route *best)
+{
+	const char *rest = uri;
+
+	while (1) {
+		const struct route *r;
+
+		for (r = node->routes; r && (!best || r->seq > best->seq);
+			r = r->next) {
+			if (r->literal ? !*rest :
+				!fnmatch(r->uri_match, uri, FNM_NOESCAPE)) {
+				best = r;
+				break;
+			}
+		}
+		if (!*rest)
+			break;
+		node = node_child(node, *rest, NULL);
+		if (!node || strncmp(node->label, rest, node->label_len))
+			break;
+		rest += node->label_len;
+	}
+	return best;
+}
+
+const struct service *service_find(const char *host, const char *uri)
+{
+	const struct host_group *g;
+	const struct route *best = NULL;
+
+	g = group_find(host, hash_str(host));
+	if (g)
+		best = node_lookup(&g->root, uri, best);
+	for (g = host_wildcards; g; g = g->next) {
+		if (!fnmatch(g->host_match, host, FNM_NOESCAPE))
+			best = node_lookup(&g->root, uri, best);
+	}
+	return best ? &best->service : NULL;
+}
+
 int service_register(const char *host_match, const char *uri_match,
 	const struct module *module, const char *arg)
 {
-	struct service_entry *se;
+	struct host_group *g;
+	struct route_node *node;
+	struct route *r;
+	size_t len = literal_len(uri_match);
 
-	se = calloc(1, sizeof(*se));
-	if (!se) {
-		perror(__func__);
-		return -1;
+	g = group_get(host_match);
+	if (!g)
+		goto failure;
+	node = node_insert(&g->root, uri_match, len);
+	if (!node)
+		goto failure;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		goto failure;
+	r->uri_match = strdup(uri_match);
+	r->service.arg = arg ? strdup(arg) : NULL;
+	if (!r->uri_match || (arg && !r->service.arg)) {
+		free(r->uri_match);
+		free(r->service.arg);
+		free(r);
+		goto failure;
 	}
-	se->host_match = strdup(host_match);
-	se->uri_match = strdup(uri_match);
-	se->service.module = module;
-	se->service.arg = arg ? strdup(arg) : NULL;
-	se->next = service_head;
-	service_head = se;
+	r->literal = uri_match[len] == 0;
+	r->seq = ++route_seq;
+	r->service.module = module;
+	r->next = node->routes;
+	node->routes = r;
 
 	return 0;
+failure:
+	perror(__func__);
+	return -1;
 }
 
 const struct module *service_module(const struct service *service)
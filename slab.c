@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/* every object is preceded by a pointer to its chunk. chunks with a free
+ * object are kept on a list, full ones are found again through their
+ * objects. one empty chunk is kept so a connection opening and closing
+ * does not call malloc each time. */
+#include <stdint.h>
+#include <stdlib.h>
+#include "logger.h"
+#include "slab.h"
+
+#define SLAB_ALIGN __alignof__(max_align_t)
+
+struct slab_chunk {
+	struct slab_chunk *next, *prev; /* partial list */
+	struct slab_obj *free;
+	unsigned used;
+};
+
+struct slab_obj {
+	union {
+		struct slab_chunk *chunk; /* while handed out */
+		struct slab_obj *next; /* while free */
+	};
+	/* keep the object aligned for any type */
+	max_align_t data[];
+};
+
+struct slab {
+	size_t stride;
+	unsigned per_chunk;
+	struct slab_chunk *partial;
+	struct slab_chunk *empty; /* spare, not on the partial list */
+	unsigned in_use, chunks;
+};
+
+struct slab *slab_new(size_t obj_size, unsigned per_chunk)
+{
+	struct slab *slab = calloc(1, sizeof(*slab));
+
+	if (!slab) {
+		SysError();
+		return NULL;
+	}
+	slab->stride = sizeof(struct slab_obj) + obj_size;
+	slab->stride = (slab->stride + SLAB_ALIGN - 1) &
+		~(SLAB_ALIGN - 1);
+	slab->per_chunk = per_chunk ? per_chunk : 1;
+	return slab;
+}
+
+static void unlink_partial(struct slab *slab, struct slab_chunk *c)
+{
+	if (c->next)
+		c->next->prev = c->prev;
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		slab->partial = c->next;
+	c->next = c->prev = NULL;
+}
+
+static void link_partial(struct slab *slab, struct slab_chunk *c)
+{
+	c->prev = NULL;
+	c->next = slab->partial;
+	if (c->next)
+		c->next->prev = c;
+	slab->partial = c;
+}
+
+static struct slab_chunk *chunk_new(struct slab *slab)
+{
+	struct slab_chunk *c;
+	struct slab_obj *o;
+	char *p;
+	unsigned i;
+
+	c = malloc(sizeof(*c) + slab->stride * slab->per_chunk +
+		SLAB_ALIGN);
+	if (!c) {
+		SysError();
+		return NULL;
+	}
+	c->next = c->prev = NULL;
+	c->used = 0;
+	c->free = NULL;
+	p = (char*)(c + 1);
+	p += -(uintptr_t)p & (SLAB_ALIGN - 1);
+	for (i = slab->per_chunk; i--; ) {
+		o = (struct slab_obj*)(p + i * slab->stride);
+		o->next = c->free;
+		c->free = o;
+	}
+	slab->chunks++;
+	return c;
+}
+
+static void chunk_release(struct slab *slab, struct slab_chunk *c)
+{
+	slab->chunks--;
+	free(c);
+}
+
+void slab_free(struct slab *slab)
+{
+	struct slab_chunk *c;
+
+	if (!slab)
+		return;
+	if (slab->in_use)
+		Warning("slab freed with %u objects in use\n", slab->in_use);
+	while ((c = slab->partial)) {
+		unlink_partial(slab, c);
+		chunk_release(slab, c);
+	}
+	if (slab->empty)
+		chunk_release(slab, slab->empty);
+	free(slab);
+}
+
+void *slab_get(struct slab *slab)
+{
+	struct slab_chunk *c = slab->partial;
+	struct slab_obj *o;
+
+	if (!c) {
+		c = slab->empty;
+		slab->empty = NULL;
+		if (!c && !(c = chunk_new(slab)))
+			return NULL;
+		link_partial(slab, c);
+	}
+	o = c->free;
+	c->free = o->next;
+	o->chunk = c;
+	if (++c->used == slab->per_chunk)
+		unlink_partial(slab, c);
+	slab->in_use++;
+	return o->data;
+}
+
+void slab_put(struct slab *slab, void *obj)
+{
+	struct slab_obj *o;
+	struct slab_chunk *c;
+
+	if (!obj)
+		return;
+	o = (struct slab_obj*)((char*)obj - offsetof(struct slab_obj, data));
+	c = o->chunk;
+	o->next = c->free;
+	c->free = o;
+	if (c->used-- == slab->per_chunk)
+		link_partial(slab, c);
+	slab->in_use--;
+	if (c->used)
+		return;
+	/* keep one spare, give the rest back */
+	unlink_partial(slab, c);
+	if (slab->empty)
+		chunk_release(slab, c);
+	else
+		slab->empty = c;
+}
+
+void slab_stats(struct slab *slab, struct slab_stats *stats)
+{
+	stats->in_use = slab->in_use;
+	stats->chunks = slab->chunks;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef SLAB_H
+#define SLAB_H
+#include <stddef.h>
+
+/* fixed size objects carved from chunks of several at a time. a chunk is
+ * returned to malloc once all of its objects are free. not thread safe,
+ * give each thread its own. */
+struct slab;
+
+struct slab_stats {
+	unsigned in_use; /* objects handed out */
+	unsigned chunks;
+};
+
+struct slab *slab_new(size_t obj_size, unsigned per_chunk);
+void slab_free(struct slab *slab);
+void *slab_get(struct slab *slab);
+void slab_put(struct slab *slab, void *obj);
+void slab_stats(struct slab *slab, struct slab_stats *stats);
+#endif
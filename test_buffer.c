@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2012-2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "buffer.h"
+#include "logger.h"
+
+static int test_buffer(void)
+{
+	char str[16];
+	struct buffer bu = buffer_wrap(str);
+	const char *p;
+
+	buffer_reset(&bu);
+	if (buffer_append(&bu, "GET / HTTP", 10)) {
+		fprintf(stderr, "%s:append failed\n", __FILE__);
+		return -1;
+	}
+	buffer_consume(&bu, 4);
+	p = buffer_data(&bu);
+	if (strcmp(p, "/ HTTP") || bu.head != 4) {
+		fprintf(stderr, "%s:consume gave \"%s\"\n", __FILE__, p);
+		return -1;
+	}
+	/* fits after tail, nothing moves */
+	if (buffer_addch(&bu, '/') || buffer_data(&bu) != p) {
+		fprintf(stderr, "%s:data moved without need\n", __FILE__);
+		return -1;
+	}
+	/* 7 + 7 + 1 only fits once the consumed bytes are reclaimed */
+	if (buffer_append(&bu, "1.1\r\nHo", 7) || bu.head != 0 ||
+		strcmp(buffer_data(&bu), "/ HTTP/1.1\r\nHo")) {
+		fprintf(stderr, "%s:compaction gave \"%s\"\n", __FILE__,
+			buffer_data(&bu));
+		return -1;
+	}
+	if (buffer_addch(&bu, 's') || !buffer_addch(&bu, 't')) {
+		fprintf(stderr, "%s:overflow not detected\n", __FILE__);
+		return -1;
+	}
+	buffer_consume(&bu, buffer_len(&bu));
+	if (bu.head || bu.tail || str[0]) {
+		fprintf(stderr, "%s:empty buffer not reset\n", __FILE__);
+		return -1;
+	}
+	return 0;
+}
+
+int main()
+{
+	if (test_buffer()) {
+		printf("%s:Test Failure\n", __FILE__);
+		return 1;
+	}
+
+	printf("%s:Test Success\n", __FILE__);
+	return 0;
+}
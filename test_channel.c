@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "channel.h"
+#include "logger.h"
+
+#define TEST_BULK 60000
+#define TEST_FILE_BULK (1 << 20)
+
+static struct channel ch;
+static unsigned char data[TEST_BULK];
+static size_t sent, received;
+static char file_data[TEST_FILE_BULK], file_out[TEST_FILE_BULK];
+
+static int send_data(int fd, size_t len)
+{
+	if (write(fd, data + sent, len) != (ssize_t)len) {
+		perror(__FILE__);
+		return -1;
+	}
+	sent += len;
+	return 0;
+}
+
+/* consume up to len bytes, checking that they arrive in order */
+static int take(size_t len)
+{
+	const char *buf;
+	size_t n;
+
+	while (len && (buf = ch_peek(&ch, &n))) {
+		if (n > len)
+			n = len;
+		if (memcmp(buf, data + received, n)) {
+			fprintf(stderr, "%s:input out of order at %zu\n",
+				__FILE__, received);
+			return -1;
+		}
+		ch_consume(&ch, n);
+		received += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int test_ring(int fd)
+{
+	unsigned fills = 0;
+	int res;
+
+	/* a small request fits the first ring */
+	if (send_data(fd, 100) || ch_fill(&ch) != 1)
+		return -1;
+	if (ch_pending(&ch) != 100 || ch.in_size != CHANNEL_READ_MIN) {
+		fprintf(stderr, "%s:pending=%zu size=%zu\n", __FILE__,
+			ch_pending(&ch), ch.in_size);
+		return -1;
+	}
+
+	/* leave some behind so the next read wraps */
+	if (take(60) || send_data(fd, 450) || ch_fill(&ch) != 1)
+		return -1;
+	if (take(ch_pending(&ch)) || received != sent)
+		return -1;
+	if (ch_fill(&ch) != 0) {
+		fprintf(stderr, "%s:expected an empty socket\n", __FILE__);
+		return -1;
+	}
+
+	/* bulk input grows the reads */
+	if (send_data(fd, TEST_BULK - sent))
+		return -1;
+	while ((res = ch_fill(&ch)) == 1) {
+		fills++;
+		if (take(ch_pending(&ch)))
+			return -1;
+	}
+	Debug("fills=%u size=%zu\n", fills, ch.in_size);
+	if (res < 0 || received != TEST_BULK) {
+		fprintf(stderr, "%s:received %zu of %u\n", __FILE__,
+			received, TEST_BULK);
+		return -1;
+	}
+	if (fills > 16) {
+		fprintf(stderr, "%s:%u reads for %u bytes\n", __FILE__,
+			fills, TEST_BULK);
+		return -1;
+	}
+	return 0;
+}
+
+/* a file sendfile() refuses is queued as a range, not as a copy of it, and
+ * ch_drain() sends it a piece at a time */
+static int test_copy(int sv[2])
+{
+	struct net_socket sock;
+	struct channel out;
+	struct mallinfo2 before, after;
+	size_t len = 0, got = 0;
+	ssize_t n;
+	int fd, res, e = -1;
+
+	/* a big seq_file, those can't be spliced */
+	fd = open("/proc/kallsyms", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	while (len < sizeof(file_data) && (n = pread(fd, file_data + len,
+		sizeof(file_data) - len, len)) > 0)
+		len += n;
+	memset(&sock, 0, sizeof(sock));
+	sock.fd = sv[0];
+	ch_init(&out, sock, "copy");
+	out.nonblock = 1;
+	before = mallinfo2();
+	if (ch_sendfile(&out, fd, 0, len) || !ch_backlogged(&out)) {
+		fprintf(stderr, "%s:the file was not queued\n", __FILE__);
+		goto done;
+	}
+	after = mallinfo2();
+	if (after.uordblks > before.uordblks + 65536) {
+		fprintf(stderr, "%s:%zu bytes held for a queued file\n",
+			__FILE__, after.uordblks - before.uordblks);
+		goto done;
+	}
+	close(fd);
+	fd = -1;
+	do {
+		res = ch_drain(&out);
+		if (res < 0)
+			goto done;
+		do {
+			n = read(sv[1], file_out + got, len - got);
+			if (n <= 0) {
+				perror(__FILE__);
+				goto done;
+			}
+			got += n;
+		} while (!res && got < len);
+	} while (res);
+	if (got != len || memcmp(file_data, file_out, len)) {
+		fprintf(stderr, "%s:the copied file differs\n", __FILE__);
+		goto done;
+	}
+	e = 0;
+done:
+	if (fd >= 0)
+		close(fd);
+	ch_close(&out);
+	close(sv[1]);
+	return e;
+}
+
+static int test(void)
+{
+	struct net_socket sock;
+	int sv[2], e;
+	size_t i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 7 + i / 251;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror(__FILE__);
+		return -1;
+	}
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	memset(&sock, 0, sizeof(sock));
+	sock.fd = sv[0];
+	ch_init(&ch, sock, "test");
+	e = test_ring(sv[1]);
+	ch_close(&ch);
+	close(sv[1]);
+	if (e)
+		return e;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror(__FILE__);
+		return -1;
+	}
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	return test_copy(sv);
+}
+
+int main()
+{
+	if (test()) {
+		printf("%s:Test Failure\n", __FILE__);
+		return 1;
+	}
+
+	printf("%s:Test Success\n", __FILE__);
+	return 0;
+}
@@ -95,9 +95,100 @@ static int test(void)
 	return 0;
 }
 
+/* names match without regard to case, and churn does not leak space */
+static int test_index(void)
+{
+	struct env env;
+	const char *value;
+	char buf[32];
+	unsigned i;
+
+	env_init(&env);
+	if (env_set(&env, "host", "example.com") ||
+		env_setn(&env, "CONNECTION: x", 10, "close\r\n", 5)) {
+		fprintf(stderr, "%s:env_set() failed\n", __FILE__);
+		return -1;
+	}
+	value = env_get(&env, "Host");
+	if (!value || strcmp(value, "example.com")) {
+		fprintf(stderr, "%s:case-insensitive env_get() failed\n",
+			__FILE__);
+		return -1;
+	}
+	value = env_get_known(&env, ENV_HOST);
+	if (!value || strcmp(value, "example.com")) {
+		fprintf(stderr, "%s:env_get_known() failed\n", __FILE__);
+		return -1;
+	}
+	value = env_get_known(&env, ENV_CONNECTION);
+	if (!value || strcmp(value, "close")) {
+		fprintf(stderr, "%s:env_setn() failed\n", __FILE__);
+		return -1;
+	}
+
+	/* overwrite far more often than the heap or index could hold */
+	for (i = 0; i < 10000; i++) {
+		snprintf(buf, sizeof(buf), "%u", i);
+		if (env_set(&env, i & 1 ? "X-Counter" : "x-counter", buf)) {
+			fprintf(stderr, "%s:env_set() failed on pass %u\n",
+				__FILE__, i);
+			return -1;
+		}
+	}
+	value = env_get(&env, "X-COUNTER");
+	if (!value || strcmp(value, "9999")) {
+		fprintf(stderr, "%s:overwritten value lost\n", __FILE__);
+		return -1;
+	}
+
+	env_delete(&env, "HOST");
+	if (env_get(&env, "host") || env_get_known(&env, ENV_HOST)) {
+		fprintf(stderr, "%s:env_delete() failed\n", __FILE__);
+		return -1;
+	}
+	value = env_get_known(&env, ENV_CONNECTION);
+	if (!value || strcmp(value, "close")) {
+		fprintf(stderr, "%s:compaction lost a known header\n",
+			__FILE__);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* an embedded NUL cannot forge a second entry */
+static int test_nul(void)
+{
+	static const char forged[] = "evil\0\1Host\0evil";
+	struct env env;
+	const char *value;
+	unsigned i;
+
+	env_init(&env);
+	if (env_set(&env, "Host", "real")) {
+		fprintf(stderr, "%s:env_set() failed\n", __FILE__);
+		return -1;
+	}
+	if (!env_setn(&env, "X-Forged", 8, forged, sizeof(forged) - 1) ||
+		!env_setn(&env, "Host\0X", 6, "evil", 4)) {
+		fprintf(stderr, "%s:env_setn() accepted a NUL\n", __FILE__);
+		return -1;
+	}
+	/* churn until the heap is compacted a few times */
+	for (i = 0; i < 1000; i++)
+		env_set(&env, "X-Counter", "0123456789");
+	value = env_get_known(&env, ENV_HOST);
+	if (!value || strcmp(value, "real") ||
+		strcmp(env_get(&env, "Host"), "real")) {
+		fprintf(stderr, "%s:Host was replaced\n", __FILE__);
+		return -1;
+	}
+	return 0;
+}
+
 int main()
 {
-	if (test()) {
+	if (test() || test_index() || test_nul()) {
 		printf("%s:Test Failure\n", __FILE__);
 		return 1;
 	}
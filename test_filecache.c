@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "filecache.h"
+#include "logger.h"
+
+#define TEST_FILES 6
+#define TEST_SIZE 100
+#define TEST_THREADS 8
+#define TEST_ROUNDS 2000
+
+static char dir[] = "/tmp/test_filecache.XXXXXX";
+static char paths[TEST_FILES][64];
+
+/* a file of len bytes, all of them fill */
+static int write_file(const char *path, size_t len, int fill)
+{
+	char buf[TEST_SIZE * 2];
+	int fd;
+
+	memset(buf, fill, len);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, buf, len) != (ssize_t)len || close(fd)) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* the entry holds len bytes of fill, resident and through its fd */
+static int check_entry(const struct filecache_entry *fe, size_t len,
+	int fill)
+{
+	char buf[TEST_SIZE * 2];
+	size_t i;
+
+	if (!fe || (size_t)fe->st.st_size != len || !fe->data ||
+		pread(fe->fd, buf, len, 0) != (ssize_t)len ||
+		strncmp(fe->header, "Content-Type: ", 14))
+		return -1;
+	for (i = 0; i < len; i++)
+		if (fe->data[i] != fill || buf[i] != fill)
+			return -1;
+	return 0;
+}
+
+static int fail(const char *what)
+{
+	fprintf(stderr, "%s:%s\n", __FILE__, what);
+	return -1;
+}
+
+/* both requests share one entry, the table keeps a reference of its own */
+static int test_refcount(void)
+{
+	struct filecache_entry *a1, *a2;
+	struct filecache_stats before, after;
+
+	filecache_config(60, 16, 1 << 20, 64 << 10);
+	filecache_stats(&before);
+	a1 = filecache_open(paths[0]);
+	a2 = filecache_open(paths[0]);
+	if (!a1 || a1 != a2 || a1->refcount != 3 || !a1->cached)
+		return fail("open did not share the entry");
+	if (check_entry(a1, TEST_SIZE, 'a'))
+		return fail("bad entry");
+	filecache_release(a1);
+	filecache_release(a2);
+	filecache_stats(&after);
+	if (a1->refcount != 1 || after.hits - before.hits != 1 ||
+		after.misses - before.misses != 1 || after.entries != 1)
+		return fail("release left the wrong count");
+	return 0;
+}
+
+static int open_release(const char *path)
+{
+	struct filecache_entry *fe = filecache_open(path);
+
+	if (!fe)
+		return -1;
+	filecache_release(fe);
+	return 0;
+}
+
+/* with room for three files, a fourth evicts the first one the clock hand
+ * finds that was not used since it last passed */
+static int test_clock(void)
+{
+	struct filecache_entry *fe = filecache_open(paths[0]);
+	struct filecache_stats before, after;
+	size_t resident;
+
+	if (!fe)
+		return fail("open failed");
+	resident = fe->resident;
+	filecache_release(fe);
+	filecache_config(60, 16, 3 * resident, 64 << 10);
+	/* a is already in and was used, b and c are new */
+	if (open_release(paths[1]) || open_release(paths[2]) ||
+		open_release(paths[2]))
+		return fail("open failed");
+	filecache_stats(&before);
+	if (before.entries != 3 || before.resident_bytes != 3 * resident)
+		return fail("files were not kept resident");
+	if (open_release(paths[3]))
+		return fail("open failed");
+	filecache_stats(&after);
+	if (after.evictions - before.evictions != 1 ||
+		after.resident_bytes > 3 * resident)
+		return fail("eviction did not keep to the budget");
+	/* a and c had a second chance, b went */
+	if (open_release(paths[0]) || open_release(paths[2]))
+		return fail("open failed");
+	filecache_stats(&before);
+	if (before.hits - after.hits != 2)
+		return fail("a recently used file was evicted");
+	if (open_release(paths[1]))
+		return fail("open failed");
+	filecache_stats(&after);
+	if (after.misses - before.misses != 1)
+		return fail("the unused file was not evicted");
+	return 0;
+}
+
+/* an entry evicted while a request holds it stays usable until released */
+static int test_pinned(void)
+{
+	struct filecache_entry *fe;
+
+	/* room for one entry, both files are new to the cache */
+	filecache_config(60, 1, 1 << 20, 64 << 10);
+	fe = filecache_open(paths[4]);
+	if (!fe || open_release(paths[5]))
+		return fail("open failed");
+	if (fe->cached || fe->refcount != 1)
+		return fail("the held entry was not evicted");
+	if (check_entry(fe, TEST_SIZE, 'e'))
+		return fail("an evicted entry was freed while held");
+	filecache_release(fe);
+	return 0;
+}
+
+/* a change in size, or only in mtime, is seen on the next open */
+static int test_revalidate(void)
+{
+	struct filecache_entry *fe;
+	struct timespec times[2] = {
+		{ 0, UTIME_OMIT }, { 1000000000, 0 },
+	};
+
+	filecache_config(0, 16, 1 << 20, 64 << 10);
+	if (open_release(paths[0]) ||
+		write_file(paths[0], TEST_SIZE * 2, 'x'))
+		return -1;
+	fe = filecache_open(paths[0]);
+	if (check_entry(fe, TEST_SIZE * 2, 'x'))
+		return fail("a new size was not noticed");
+	filecache_release(fe);
+	if (write_file(paths[0], TEST_SIZE * 2, 'y') ||
+		utimensat(AT_FDCWD, paths[0], times, 0))
+		return fail("could not rewrite the file");
+	fe = filecache_open(paths[0]);
+	if (check_entry(fe, TEST_SIZE * 2, 'y'))
+		return fail("a new mtime was not noticed");
+	filecache_release(fe);
+	return 0;
+}
+
+/* lookups from many threads, evicting as they go, each see whole entries */
+static void *lookup_thread(void *arg)
+{
+	unsigned seed = (unsigned)(size_t)arg, i, n;
+	struct filecache_entry *fe;
+	size_t bad = 0;
+
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		seed = seed * 1103515245 + 12345;
+		n = 1 + (seed >> 16) % (TEST_FILES - 1);
+		fe = filecache_open(paths[n]);
+		if (check_entry(fe, TEST_SIZE, 'a' + n))
+			bad++;
+		if (fe)
+			filecache_release(fe);
+	}
+	return (void*)bad;
+}
+
+static int test_concurrent(void)
+{
+	pthread_t th[TEST_THREADS];
+	struct filecache_stats before, after;
+	void *bad;
+	unsigned i, started;
+	int e = 0;
+
+	/* paths[0] was rewritten by test_revalidate, the others are intact */
+	filecache_config(60, 3, 1 << 20, 64 << 10);
+	filecache_stats(&before);
+	for (started = 0; started < TEST_THREADS; started++)
+		if (pthread_create(&th[started], NULL, lookup_thread,
+			(void*)(size_t)(started + 1)))
+			break;
+	for (i = 0; i < started; i++) {
+		pthread_join(th[i], &bad);
+		if (bad)
+			e = fail("a thread saw a bad entry");
+	}
+	if (started != TEST_THREADS)
+		return fail("could not start the threads");
+	filecache_stats(&after);
+	if (after.hits - before.hits + after.misses - before.misses !=
+		(unsigned long)TEST_THREADS * TEST_ROUNDS)
+		return fail("lookups went uncounted");
+	if (after.entries > 3)
+		return fail("the table grew past its limit");
+	return e;
+}
+
+static int test(void)
+{
+	unsigned i;
+	int e;
+
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		return -1;
+	}
+	for (i = 0; i < TEST_FILES; i++) {
+		snprintf(paths[i], sizeof(paths[i]), "%s/%c.txt", dir, 'a' + i);
+		if (write_file(paths[i], TEST_SIZE, 'a' + i))
+			return -1;
+	}
+	e = test_refcount() || test_clock() || test_pinned() ||
+		test_revalidate() || test_concurrent();
+	for (i = 0; i < TEST_FILES; i++)
+		unlink(paths[i]);
+	rmdir(dir);
+	return e;
+}
+
+int main()
+{
+	if (test()) {
+		printf("%s:Test Failure\n", __FILE__);
+		return 1;
+	}
+
+	printf("%s:Test Success\n", __FILE__);
+	return 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "httpd.h"
+#include "service.h"
+#include "mod_static_files.h"
+#include "mod_counter.h"
+
+#define TEST_FILE "hello\n"
+#define TEST_BIG_SIZE (32L << 20) /* more than the socket buffers hold */
+
+static char dir[] = "/tmp/test_httpd.XXXXXX";
+static char path[64], big_path[64];
+static char port[8];
+static pthread_t server_th;
+
+static void *server_start(void *p)
+{
+	(void)p;
+	httpd_loop();
+	return NULL;
+}
+
+/* rcvbuf shrinks the receive buffer when not 0 */
+static int client_connect(int rcvbuf)
+{
+	struct sockaddr_in sin;
+	struct timeval tv = { 5, 0 };
+	int fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(port));
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (rcvbuf)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+			sizeof(rcvbuf));
+	if (connect(fd, (struct sockaddr*)&sin, sizeof(sin))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* send a request and read until the server closes the connection */
+static ssize_t exchange(const char *req, char *buf, size_t max)
+{
+	size_t len = 0;
+	ssize_t res;
+	int fd;
+
+	fd = client_connect(0);
+	if (fd < 0 || write(fd, req, strlen(req)) != (ssize_t)strlen(req)) {
+		perror(__FILE__);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	while (len < max - 1 && (res = read(fd, buf + len, max - 1 - len)))
+	{
+		if (res < 0) {
+			perror(__FILE__);
+			close(fd);
+			return -1;
+		}
+		len += res;
+	}
+	buf[len] = 0;
+	close(fd);
+	return len;
+}
+
+/* a HEAD response has no body, the pipelined request after it must be
+ * answered right after its headers */
+static int test_head(void)
+{
+	char buf[1024];
+	const char *second;
+
+	if (exchange("HEAD /a.txt HTTP/1.1\r\nHost: x\r\n\r\n"
+		"GET /counter HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n",
+		buf, sizeof(buf)) < 0)
+		return -1;
+	second = strstr(buf, "\r\n\r\n");
+	if (strncmp(buf, "HTTP/1.1 200 ", 13) ||
+		!strstr(buf, "Content-Length: 6\r\n") ||
+		!second || strncmp(second + 4, "HTTP/1.1 200 ", 13) ||
+		strstr(buf, TEST_FILE)) {
+		fprintf(stderr, "%s:bad HEAD response:\n%s\n", __FILE__, buf);
+		return -1;
+	}
+	return 0;
+}
+
+/* a client that stops reading a large response must not hold up the
+ * other connections of its event loop. the request it pipelined behind
+ * that response is answered once it reads again. */
+static int test_stalled_reader(void)
+{
+	static const char req[] = "GET /big.bin HTTP/1.1\r\nHost: x\r\n\r\n"
+		"GET /a.txt HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n";
+	char buf[65536], tail[sizeof(TEST_FILE)] = "";
+	const size_t tail_len = sizeof(tail) - 1;
+	long long total = 0;
+	ssize_t res;
+	int fd, e = -1;
+
+	fd = client_connect(4096);
+	if (fd < 0 || write(fd, req, sizeof(req) - 1) != sizeof(req) - 1) {
+		perror(__FILE__);
+		goto out;
+	}
+	usleep(200000); /* the server fills the socket and has to queue */
+	if (exchange("GET /a.txt HTTP/1.1\r\nHost: x\r\n"
+		"Connection: close\r\n\r\n", buf, sizeof(buf)) <= 0 ||
+		!strstr(buf, TEST_FILE)) {
+		fprintf(stderr, "%s:blocked behind a stalled client\n",
+			__FILE__);
+		goto out;
+	}
+	while ((res = read(fd, buf, sizeof(buf))) > 0) {
+		if ((size_t)res >= tail_len) {
+			memcpy(tail, buf + res - tail_len, tail_len);
+		} else {
+			memmove(tail, tail + res, tail_len - res);
+			memcpy(tail + tail_len - res, buf, res);
+		}
+		total += res;
+	}
+	if (res < 0 || total < TEST_BIG_SIZE || strcmp(tail, TEST_FILE)) {
+		fprintf(stderr, "%s:stalled client got %lld bytes\n",
+			__FILE__, total);
+		goto out;
+	}
+	e = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	return e;
+}
+
+/* the server has closed fd, or reset it */
+static int closed(int fd)
+{
+	char buf[64];
+	ssize_t res;
+
+	res = read(fd, buf, sizeof(buf));
+	return res == 0 || (res < 0 && errno == ECONNRESET);
+}
+
+/* a client that sends nothing, and one that sends its header a byte at a
+ * time, are both closed once the timeout passes */
+static int test_timeout(void)
+{
+	static const char part[] = "GET /a.txt HTTP/1.1\r\nX-Slow: ";
+	int quiet, slow, i, e = -1;
+
+	quiet = client_connect(0);
+	slow = client_connect(0);
+	if (quiet < 0 || slow < 0 ||
+		write(slow, part, sizeof(part) - 1) != sizeof(part) - 1) {
+		perror(__FILE__);
+		goto out;
+	}
+	/* each byte is in time, the header as a whole is not */
+	for (i = 0; i < 20; i++) {
+		usleep(200000);
+		if (write(slow, "x", 1) != 1)
+			break;
+	}
+	if (!closed(quiet) || !closed(slow)) {
+		fprintf(stderr, "%s:a connection outlived the timeout\n",
+			__FILE__);
+		goto out;
+	}
+	e = 0;
+out:
+	if (quiet >= 0)
+		close(quiet);
+	if (slow >= 0)
+		close(slow);
+	return e;
+}
+
+static int setup(void)
+{
+	FILE *f;
+	int fd;
+
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/a.txt", dir);
+	f = fopen(path, "w");
+	if (!f || fputs(TEST_FILE, f) == EOF || fclose(f)) {
+		perror(path);
+		return -1;
+	}
+	/* sparse, it is only ever sent */
+	snprintf(big_path, sizeof(big_path), "%s/big.bin", dir);
+	fd = open(big_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, TEST_BIG_SIZE) || close(fd)) {
+		perror(big_path);
+		return -1;
+	}
+	/* the newest matching route wins */
+	if (service_register("*", "/*", &mod_static_files, dir) ||
+		service_register("*", "/counter", &mod_counter, NULL))
+		return -1;
+	snprintf(port, sizeof(port), "%u", 20000 + (unsigned)getpid() % 20000);
+	httpd_eventloops(1);
+	httpd_drain_timeout(1);
+	httpd_keepalive(100, 1);
+	if (httpd_start("127.0.0.1", port))
+		return -1;
+	/* httpd_start() blocked the control signals, the thread inherits
+	 * that and waits for them in httpd_loop() */
+	if (pthread_create(&server_th, NULL, server_start, NULL))
+		return -1;
+	return 0;
+}
+
+static void teardown(void)
+{
+	kill(getpid(), SIGTERM);
+	pthread_join(server_th, NULL);
+	unlink(path);
+	unlink(big_path);
+	rmdir(dir);
+}
+
+static int test(void)
+{
+	int e;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (setup()) {
+		fprintf(stderr, "%s:could not start the server\n", __FILE__);
+		return -1;
+	}
+	e = test_head();
+	if (!e)
+		e = test_stalled_reader();
+	if (!e)
+		e = test_timeout();
+	teardown();
+	return e;
+}
+
+int main()
+{
+	if (test()) {
+		printf("%s:Test Failure\n", __FILE__);
+		return 1;
+	}
+
+	printf("%s:Test Success\n", __FILE__);
+	return 0;
+}
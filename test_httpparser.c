@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <stdio.h>
+#include <string.h>
 #include "httpparser.h"
 
 static const char testdata1[] =
@@ -42,6 +43,19 @@ static const char testdata2[] =
 	"\r\n";
 static size_t testdata2_len = sizeof(testdata2) - 1;
 
+/* two pipelined requests in one read */
+static const char testdata3[] =
+	"GET /first HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"\r\n"
+	"GET /second HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+static size_t testdata3_len = sizeof(testdata3) - 1;
+
+static unsigned header_done_count;
+
 static void on_method(void *p, const char *method, const char *uri)
 {
 	printf("%p:method=\"%s\" uri=\"%s\"\n", p, method, uri);
@@ -55,6 +69,7 @@ static void on_header(void *p, const char *name, const char *value)
 static void on_header_done(void *p)
 {
 	printf("%p:HEADER DONE!\n", p);
+	header_done_count++;
 }
 
 static void on_data(void *p, size_t len, const void *data)
@@ -62,9 +77,234 @@ static void on_data(void *p, size_t len, const void *data)
 	printf("%p:len=%zd data=%p\n", p, len, data);
 }
 
+/* everything the span callbacks reported, for comparing two parses */
+static char record[4096];
+static size_t record_len;
+
+static void record_add(const char *a, size_t a_len, const char *b,
+	size_t b_len)
+{
+	record_len += snprintf(record + record_len, sizeof(record) - record_len,
+		"[%.*s|%.*s]", (int)a_len, a, (int)b_len, b);
+	if (record_len >= sizeof(record))
+		record_len = sizeof(record) - 1;
+}
+
+static void span_method(void *p, const char *method, size_t method_len,
+	const char *uri, size_t uri_len)
+{
+	(void)p;
+	record_add(method, method_len, uri, uri_len);
+}
+
+static void span_header(void *p, const char *name, size_t name_len,
+	const char *value, size_t value_len)
+{
+	(void)p;
+	record_add(name, name_len, value, value_len);
+}
+
+/* feed data in pieces of size step, so tokens straddle the reads */
+static int parse_split(const char *data, size_t len, size_t step)
+{
+	struct httpparser hp;
+	size_t ofs;
+	int res;
+
+	record_len = 0;
+	httpparser_init(&hp);
+	for (ofs = 0; ofs < len && !hp.done; ofs += res) {
+		size_t n = len - ofs < step ? len - ofs : step;
+
+		res = httpparser_span(&hp, data + ofs, n, NULL, span_method,
+			span_header, NULL, NULL);
+		if (res < 0) {
+			httpparser_free(&hp);
+			return -1;
+		}
+	}
+	httpparser_free(&hp);
+	return hp.done ? 0 : -1;
+}
+
+static int test_split(void)
+{
+	char whole[sizeof(record)];
+	size_t step;
+
+	if (parse_split(testdata2, testdata2_len, testdata2_len))
+		return -1;
+	memcpy(whole, record, record_len + 1);
+	printf("%s\n", whole);
+	for (step = 1; step < 64; step++) {
+		if (parse_split(testdata2, testdata2_len, step) ||
+			strcmp(whole, record)) {
+			printf("%s:split parse differs at step %zu\n",
+				__FILE__, step);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* control characters in a header, the lengths cover an embedded NUL */
+static const struct {
+	const char *data;
+	size_t len;
+} bad_headers[] = {
+#define BAD_HEADER(s) { s, sizeof(s) - 1 }
+	BAD_HEADER("GET / HTTP/1.1\r\nX-A: evil\0\1Host\0evil\r\n\r\n"),
+	BAD_HEADER("GET / HTTP/1.1\r\nX\0Host: evil\r\n\r\n"),
+	BAD_HEADER("GET / HTTP/1.1\r\nX-A: a\033b\r\n\r\n"),
+	BAD_HEADER("GET / HTTP/1.1\r\nX-A: a\177b\r\n\r\n"),
+	BAD_HEADER("GET / HTTP/1.1\r\nX-A: a\rb\r\n\r\n"),
+#undef BAD_HEADER
+};
+
+static int test_ctl(void)
+{
+	static const char tab[] = "GET / HTTP/1.1\r\nX-A: a\tb\r\n\r\n";
+	unsigned i;
+	size_t step;
+
+	for (step = 1; step < 64; step++) {
+		for (i = 0; i < sizeof(bad_headers) / sizeof(*bad_headers);
+			i++) {
+			if (!parse_split(bad_headers[i].data,
+				bad_headers[i].len, step)) {
+				printf("%s:bad header %u was accepted\n",
+					__FILE__, i);
+				return -1;
+			}
+		}
+		if (parse_split(tab, sizeof(tab) - 1, step)) {
+			printf("%s:a tab in a value was refused\n", __FILE__);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* bodies, each followed by a pipelined request */
+static const char testdata4[] =
+	"POST /upload HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"Content-Length: 11\r\n"
+	"\r\n"
+	"hello world"
+	"GET /next HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"\r\n";
+static size_t testdata4_len = sizeof(testdata4) - 1;
+
+static const char testdata5[] =
+	"POST /upload HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"\r\n"
+	"5;name=value\r\n"
+	"hello\r\n"
+	"6\r\n"
+	" world\r\n"
+	"0\r\n"
+	"X-Checksum: 1234\r\n"
+	"\r\n"
+	"GET /next HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"\r\n";
+static size_t testdata5_len = sizeof(testdata5) - 1;
+
+static const char *bad_bodies[] = {
+	"POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n",
+	"POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n",
+	"POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n",
+	"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nxyz\r\n",
+	"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"1\r\nab\r\n",
+	"POST / HTTP/1.1\r\nContent-Length: 3\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n0\r\n\r\n",
+	"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+		"Content-Length: 0\r\n\r\n0\r\n\r\n",
+};
+
+static char body[64];
+static size_t body_len;
+static unsigned body_end_count;
+
+static void body_data(void *p, size_t len, const void *data)
+{
+	(void)p;
+	if (!len) {
+		body_end_count++;
+		return;
+	}
+	if (body_len + len > sizeof(body))
+		len = sizeof(body) - body_len;
+	memcpy(body + body_len, data, len);
+	body_len += len;
+}
+
+/* parse the messages in data, fed step bytes at a time */
+static int parse_body(const char *data, size_t len, size_t step)
+{
+	struct httpparser hp;
+	size_t ofs = 0;
+	int res;
+
+	body_len = 0;
+	body_end_count = 0;
+	header_done_count = 0;
+	httpparser_init(&hp);
+	while (ofs < len) {
+		size_t n = len - ofs < step ? len - ofs : step;
+
+		res = httpparser_span(&hp, data + ofs, n, NULL, NULL, NULL,
+			on_header_done, body_data);
+		if (res < 0) {
+			httpparser_free(&hp);
+			return -1;
+		}
+		ofs += res;
+		if (hp.done)
+			httpparser_init(&hp);
+	}
+	httpparser_free(&hp);
+	return 0;
+}
+
+static int test_body(void)
+{
+	const char *data[] = { testdata4, testdata5 };
+	size_t len[] = { testdata4_len, testdata5_len };
+	unsigned i;
+	size_t step;
+
+	for (i = 0; i < 2; i++) {
+		for (step = 1; step < 64; step++) {
+			if (parse_body(data[i], len[i], step) ||
+				body_len != 11 ||
+				memcmp(body, "hello world", 11) ||
+				body_end_count != 1 || header_done_count != 2) {
+				printf("%s:body %u failed at step %zu\n",
+					__FILE__, i, step);
+				return -1;
+			}
+		}
+	}
+	for (i = 0; i < sizeof(bad_bodies) / sizeof(*bad_bodies); i++) {
+		if (!parse_body(bad_bodies[i], strlen(bad_bodies[i]), 64)) {
+			printf("%s:bad body %u was accepted\n", __FILE__, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int main()
 {
 	struct httpparser hp;
+	size_t ofs;
+	int res;
 
 	httpparser_init(&hp);
 	httpparser(&hp, testdata1, testdata1_len, NULL, on_method, on_header,
@@ -73,6 +313,25 @@ int main()
 	httpparser_init(&hp);
 	httpparser(&hp, testdata2, testdata2_len, NULL, on_method, on_header,
 		on_header_done, on_data);
+
+	/* restart on the leftover bytes after each message */
+	header_done_count = 0;
+	for (ofs = 0; ofs < testdata3_len; ofs += res) {
+		httpparser_init(&hp);
+		res = httpparser(&hp, testdata3 + ofs, testdata3_len - ofs,
+			NULL, on_method, on_header, on_header_done, on_data);
+		if (res <= 0 || !hp.done) {
+			printf("%s:pipelined parse failed\n", __FILE__);
+			return 1;
+		}
+	}
+	if (header_done_count != 2) {
+		printf("%s:expected 2 pipelined requests, got %u\n",
+			__FILE__, header_done_count);
+		return 1;
+	}
+	if (test_split() || test_ctl() || test_body())
+		return 1;
 	return 0;
 }
 
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "net.h"
+#include "logger.h"
+
+#ifndef ARRAY_SIZE
+# define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+#endif
+
+static void make_socket(struct net_socket *sock, int family,
+	const char *addr, unsigned port)
+{
+	struct sockaddr_in *sin = (void*)&sock->addr;
+	struct sockaddr_in6 *sin6 = (void*)&sock->addr;
+
+	memset(sock, 0, sizeof(*sock));
+	sock->fd = -1;
+	if (family == AF_INET) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		inet_pton(AF_INET, addr, &sin->sin_addr);
+		sock->addrlen = sizeof(*sin);
+	} else {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		inet_pton(AF_INET6, addr, &sin6->sin6_addr);
+		sock->addrlen = sizeof(*sin6);
+	}
+}
+
+static int test_name(void)
+{
+	struct {
+		int family;
+		const char *addr;
+		unsigned port;
+		const char *result;
+	} data[] = {
+		{ AF_INET, "127.0.0.1", 8080, "127.0.0.1:8080" },
+		{ AF_INET, "10.1.2.3", 0, "10.1.2.3:0" },
+		{ AF_INET, "255.255.255.255", 65535,
+			"255.255.255.255:65535" },
+		{ AF_INET6, "::1", 443, "::1:443" },
+		{ AF_INET6, "::ffff:192.0.2.1", 80, "::ffff:192.0.2.1:80" },
+		{ AF_INET6, "2001:db8::8:800:200c:417a", 1,
+			"2001:db8::8:800:200c:417a:1" },
+	};
+	struct net_socket sock;
+	char buf[NET_NAME_MAX];
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(data); i++) {
+		make_socket(&sock, data[i].family, data[i].addr, data[i].port);
+		net_socket_name(&sock, buf, sizeof(buf));
+		Debug("addr=%s name=%s\n", data[i].addr, buf);
+		if (strcmp(buf, data[i].result)) {
+			fprintf(stderr, "%s:expected \"%s\", got \"%s\"\n",
+				__FILE__, data[i].result, buf);
+			return -1;
+		}
+	}
+
+	/* a short buffer keeps the address and drops the port */
+	make_socket(&sock, AF_INET, "127.0.0.1", 8080);
+	net_socket_name(&sock, buf, 12);
+	if (strcmp(buf, "127.0.0.1")) {
+		fprintf(stderr, "%s:short buffer gave \"%s\"\n", __FILE__, buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+#define GROUP_SIZE 3
+
+static int group_fds[GROUP_SIZE];
+static unsigned group_count;
+
+static void group_create(void *p, struct net_listen sock, size_t desc_len,
+	const char *desc)
+{
+	(void)p;
+	(void)desc_len;
+	(void)desc;
+	if (group_count < GROUP_SIZE)
+		group_fds[group_count] = sock.fd;
+	group_count++;
+}
+
+/* an upgrade hands a SO_REUSEPORT group down in any order, each socket
+ * must be adopted at its old place in the group */
+static int test_inherit(void)
+{
+	int fds[GROUP_SIZE];
+	char list[64], port[8];
+	size_t len = 0;
+	unsigned i;
+	int e = -1;
+
+	snprintf(port, sizeof(port), "%u", 20000 + (unsigned)getpid() % 20000);
+	if (net_listen_group(group_create, NULL, "127.0.0.1", port,
+		GROUP_SIZE, NET_REUSEPORT) || group_count != GROUP_SIZE) {
+		fprintf(stderr, "%s:could not listen on %s\n", __FILE__, port);
+		return -1;
+	}
+	memcpy(fds, group_fds, sizeof(fds));
+	for (i = GROUP_SIZE; i-- > 0; )
+		len += snprintf(list + len, sizeof(list) - len, "%s%d:%u",
+			len ? "," : "", fds[i], i);
+	group_count = 0;
+	if (net_inherit(list) || net_listen_group(group_create, NULL,
+		"127.0.0.1", port, GROUP_SIZE, NET_REUSEPORT) ||
+		group_count != GROUP_SIZE)
+		goto out;
+	for (i = 0; i < GROUP_SIZE; i++) {
+		if (group_fds[i] != fds[i]) {
+			fprintf(stderr, "%s:listener %u adopted fd %d, "
+				"expected %d\n", __FILE__, i, group_fds[i],
+				fds[i]);
+			goto out;
+		}
+	}
+	e = 0;
+out:
+	net_inherit_close();
+	for (i = 0; i < GROUP_SIZE; i++)
+		close(fds[i]);
+	return e;
+}
+
+int main()
+{
+	if (test_name() || test_inherit()) {
+		printf("%s:Test Failure\n", __FILE__);
+		return 1;
+	}
+
+	printf("%s:Test Success\n", __FILE__);
+	return 0;
+}
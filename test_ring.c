@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ring.h"
+#include "logger.h"
+
+#define THREADS 4
+#define PER_THREAD 100000
+
+static struct ring *ring;
+static unsigned char *seen;
+static unsigned long popped;
+
+/* fills and drains from one thread, checking the order and the bounds */
+static int test_single(void)
+{
+	struct ring *r = ring_new(5, sizeof(unsigned));
+	unsigned i, v;
+
+	if (!r)
+		return -1;
+	for (i = 0; i < 8; i++)
+		if (ring_push(r, &i)) {
+			fprintf(stderr, "%s:push %u failed\n", __FILE__, i);
+			return -1;
+		}
+	if (!ring_push(r, &i) || ring_count(r) != 8) {
+		fprintf(stderr, "%s:ring should be full\n", __FILE__);
+		return -1;
+	}
+	for (i = 0; i < 8; i++)
+		if (ring_pop(r, &v) || v != i) {
+			fprintf(stderr, "%s:pop %u failed\n", __FILE__, i);
+			return -1;
+		}
+	if (!ring_pop(r, &v) || ring_count(r) != 0) {
+		fprintf(stderr, "%s:ring should be empty\n", __FILE__);
+		return -1;
+	}
+	ring_free(r);
+	return 0;
+}
+
+static void *producer(void *p)
+{
+	unsigned base = *(unsigned*)p * PER_THREAD;
+	unsigned i, v;
+
+	for (i = 0; i < PER_THREAD; i++) {
+		v = base + i;
+		while (ring_push(ring, &v))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void *consumer(void *p)
+{
+	unsigned v;
+
+	while (__atomic_load_n(&popped, __ATOMIC_RELAXED)
+		< THREADS * PER_THREAD) {
+		if (ring_pop(ring, &v)) {
+			sched_yield();
+			continue;
+		}
+		/* every value must come out exactly once */
+		if (v >= THREADS * PER_THREAD
+			|| __atomic_fetch_add(&seen[v], 1, __ATOMIC_RELAXED)) {
+			fprintf(stderr, "%s:bad value %u\n", __FILE__, v);
+			exit(1);
+		}
+		__atomic_add_fetch(&popped, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* many producers and consumers racing on a small ring */
+static int test_threads(void)
+{
+	pthread_t prod[THREADS], cons[THREADS];
+	unsigned id[THREADS];
+	unsigned i;
+
+	ring = ring_new(64, sizeof(unsigned));
+	seen = calloc(THREADS * PER_THREAD, 1);
+	if (!ring || !seen)
+		return -1;
+	for (i = 0; i < THREADS; i++) {
+		id[i] = i;
+		if (pthread_create(&cons[i], NULL, consumer, NULL)
+			|| pthread_create(&prod[i], NULL, producer, &id[i]))
+			return -1;
+	}
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(prod[i], NULL);
+		pthread_join(cons[i], NULL);
+	}
+	for (i = 0; i < THREADS * PER_THREAD; i++)
+		if (seen[i] != 1) {
+			fprintf(stderr, "%s:lost value %u\n", __FILE__, i);
+			return -1;
+		}
+	ring_free(ring);
+	free(seen);
+	return 0;
+}
+
+int main()
+{
+	if (test_single() || test_threads()) {
+		printf("%s:Test Failure\n", __FILE__);
+		return 1;
+	}
+
+	printf("%s:Test Success\n", __FILE__);
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "module.h"
+#include "service.h"
+
+#ifndef ARRAY_SIZE
+# define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+#endif
+
+static const struct module test_module = { .desc = __FILE__ };
+
+static const struct {
+	const char *host_match;
+	const char *uri_match;
+	const char *arg;
+} routes[] = {
+	{ "*", "/*", "default" },
+	{ "*", "/counter", "counter" },
+	{ "example.com", "/img/*", "img" },
+	{ "example.com", "/img/logo.png", "logo" },
+	{ "*.example.com", "/api/v[12]/*", "api" },
+	{ "*", "/im*", "im" },
+	{ "example.com", "/i", "i" },
+	{ "localhost", "*", "local" },
+	{ "*", "/counter/x?", "counter-x" },
+	{ "example.com", "/", "root" },
+	{ "*", "/img/*.gif", "gif" },
+	{ "www.example.com", "/api/v1/status", "status" },
+};
+
+static const char *hosts[] = {
+	"example.com", "www.example.com", "localhost", "other", "",
+};
+
+static const char *uris[] = {
+	"/", "/i", "/im", "/img", "/img/", "/img/logo.png", "/img/a.gif",
+	"/counter", "/counter/", "/counter/xy", "/counter/xyz", "/api/v1/x",
+	"/api/v2/", "/api/v3/x", "/api/v1/status", "/api/v1/statusx", "",
+	"x", "/imgx/a.gif",
+};
+
+/* what the old linear scan returned, the newest matching registration */
+static const char *expected(const char *host, const char *uri)
+{
+	unsigned i = ARRAY_SIZE(routes);
+
+	while (i--) {
+		if (!fnmatch(routes[i].host_match, host, FNM_NOESCAPE) &&
+			!fnmatch(routes[i].uri_match, uri, FNM_NOESCAPE))
+			return routes[i].arg;
+	}
+	return NULL;
+}
+
+static int test(void)
+{
+	unsigned i, j;
+
+	for (i = 0; i < ARRAY_SIZE(routes); i++) {
+		if (service_register(routes[i].host_match, routes[i].uri_match,
+			&test_module, routes[i].arg)) {
+			fprintf(stderr, "%s:service_register() failed\n",
+				__FILE__);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hosts); i++) {
+		for (j = 0; j < ARRAY_SIZE(uris); j++) {
+			const struct service *serv;
+			const char *want = expected(hosts[i], uris[j]);
+			const char *got;
+
+			serv = service_find(hosts[i], uris[j]);
+			got = service_arg(serv);
+			if (serv && service_module(serv) != &test_module) {
+				fprintf(stderr, "%s:wrong module\n", __FILE__);
+				return -1;
+			}
+			if (want != got && (!want || !got || strcmp(want, got))) {
+				fprintf(stderr, "%s:host \"%s\" uri \"%s\" "
+					"found \"%s\" expected \"%s\"\n",
+					__FILE__, hosts[i], uris[j],
+					got ? got : "(none)",
+					want ? want : "(none)");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int main()
+{
+	if (test()) {
+		printf("%s:Test Failure\n", __FILE__);
+		return 1;
+	}
+
+	printf("%s:Test Success\n", __FILE__);
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2013 Jon Mayo
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "slab.h"
+#include "logger.h"
+
+#define TEST_OBJECTS 100
+#define TEST_PER_CHUNK 8
+
+static int test_slab(void)
+{
+	struct slab *slab = slab_new(37, TEST_PER_CHUNK);
+	struct slab_stats st;
+	unsigned char *obj[TEST_OBJECTS];
+	unsigned i, j;
+
+	if (!slab)
+		return -1;
+	for (i = 0; i < TEST_OBJECTS; i++) {
+		obj[i] = slab_get(slab);
+		if (!obj[i] || (uintptr_t)obj[i] % __alignof__(max_align_t)) {
+			fprintf(stderr, "%s:bad object %u\n", __FILE__, i);
+			return -1;
+		}
+		memset(obj[i], i, 37);
+	}
+	for (i = 0; i < TEST_OBJECTS; i++)
+		for (j = 0; j < 37; j++)
+			if (obj[i][j] != (unsigned char)i) {
+				fprintf(stderr, "%s:objects %u overlap\n",
+					__FILE__, i);
+				return -1;
+			}
+	slab_stats(slab, &st);
+	Debug("in_use=%u chunks=%u\n", st.in_use, st.chunks);
+	if (st.in_use != TEST_OBJECTS ||
+		st.chunks != (TEST_OBJECTS + TEST_PER_CHUNK - 1) /
+		TEST_PER_CHUNK) {
+		fprintf(stderr, "%s:in_use=%u chunks=%u\n", __FILE__,
+			st.in_use, st.chunks);
+		return -1;
+	}
+
+	/* the odd ones, then reuse them */
+	for (i = 1; i < TEST_OBJECTS; i += 2)
+		slab_put(slab, obj[i]);
+	for (i = 1; i < TEST_OBJECTS; i += 2)
+		obj[i] = slab_get(slab);
+	slab_stats(slab, &st);
+	if (st.chunks != (TEST_OBJECTS + TEST_PER_CHUNK - 1) /
+		TEST_PER_CHUNK) {
+		fprintf(stderr, "%s:free objects were not reused\n", __FILE__);
+		return -1;
+	}
+
+	/* everything back, only the spare chunk stays */
+	for (i = 0; i < TEST_OBJECTS; i++)
+		slab_put(slab, obj[TEST_OBJECTS - 1 - i]);
+	slab_stats(slab, &st);
+	Debug("in_use=%u chunks=%u\n", st.in_use, st.chunks);
+	if (st.in_use || st.chunks != 1) {
+		fprintf(stderr, "%s:in_use=%u chunks=%u after release\n",
+			__FILE__, st.in_use, st.chunks);
+		return -1;
+	}
+	slab_free(slab);
+
+	return 0;
+}
+
+int main()
+{
+	if (test_slab()) {
+		printf("%s:Test Failure\n", __FILE__);
+		return 1;
+	}
+
+	printf("%s:Test Success\n", __FILE__);
+	return 0;
+}
@@ -27,7 +27,6 @@ const char *util_basename(const char *path)
 
 int util_fixpath(char *dest, size_t dest_len, const char *path)
 {
-	int st = 0;
 	char *out = dest;
 	int absolute = path[0] == '/';
 	int prev_slash = 1; /* any seperator, either / or start of string. */
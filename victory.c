@@ -130,7 +130,7 @@ void ht_response(struct channel *ch, int status_code)
 	case 504: resp = "HTTP/1.1 504 Gateway Timeout\r\n"; break;
 	case 505: resp = "HTTP/1.1 505 HTTP Version Not Supported\r\n"; break;
 	}
-	Debug("CHAN=%s status_code=%d\n", ch->desc, status_code);
+	Debug("CHAN=%s status_code=%d\n", ch_desc(ch), status_code);
 	ch_puts(ch, resp);
 }
 
@@ -159,7 +159,8 @@ static int env_find(const struct env *env, const char *name,
 	unsigned rem, len;
 	const char *s;
 
-	for (rem = bu->cur, s = bu->data; rem > 0; rem -= len, s += len) {
+	for (rem = buffer_len(bu), s = buffer_data(bu); rem > 0;
+		rem -= len, s += len) {
 		assert(rem != 0);
 		len = strlen(s) + 1;
 		assert(s[len - 1] == 0);
@@ -208,9 +209,9 @@ static int env_set(struct env *env, const char *n, const char *v)
 
 	nlen = strlen(n) + 1;
 	vlen = strlen(v) + 1;
-	if (bu->cur + nlen + vlen > bu->max)
+	if (bu->tail + nlen + vlen > bu->max)
 		return -1;
-	s = bu->data + bu->cur;
+	s = bu->data + bu->tail;
 
 	memcpy(s, n, nlen);
 	s += nlen;
@@ -220,8 +221,8 @@ static int env_set(struct env *env, const char *n, const char *v)
 	s += vlen;
 	assert(s[-1] == 0);
 
-	bu->cur = s - bu->data;
-	assert(bu->cur <= bu->max);
+	bu->tail = s - bu->data;
+	assert(bu->tail <= bu->max);
 	return 0;
 }
 
@@ -240,8 +241,8 @@ static void hs_init(struct headers_state *hs)
 static int methodline_parse(struct buffer *bu, struct methodline_state *ms,
 	struct buffer *method, struct buffer *uri, struct buffer *version)
 {
-	const char *s = bu->data;
-	unsigned rem = bu->cur;
+	const char *s = buffer_data(bu);
+	unsigned rem = buffer_len(bu);
 	char ch;
 
 	while (rem > 0) {
@@ -281,18 +282,18 @@ static int methodline_parse(struct buffer *bu, struct methodline_state *ms,
 		}
 	}
 
-	buffer_consume(bu, s - bu->data);
+	buffer_consume(bu, s - buffer_data(bu));
 	return 0;
 complete:
 	ms->done = true;
-	buffer_consume(bu, s - bu->data);
+	buffer_consume(bu, s - buffer_data(bu));
 	return 0;
 parse_error:
 	Error("%s():parse failure (%.*s)\n",
-		__func__, bu->cur, bu->data);
-	buffer_consume(bu, s - bu->data);
+		__func__, buffer_len(bu), buffer_data(bu));
+	buffer_consume(bu, s - buffer_data(bu));
 	Error("%s():parse failure @ %d (state=%d)\n",
-		__func__, bu->cur, ms->state);
+		__func__, buffer_len(bu), ms->state);
 	return -1;
 }
 
@@ -321,8 +322,8 @@ static int ht_method(struct channel *ch, struct buffer *bu,
 static int headers_parse(struct buffer *bu, struct headers_state *hs,
 	struct buffer *name, struct buffer *value, struct env *env)
 {
-	const char *s = bu->data;
-	unsigned rem = bu->cur;
+	const char *s = buffer_data(bu);
+	unsigned rem = buffer_len(bu);
 	char ch;
 
 	// TODO: 413 Entity Too Large
@@ -334,16 +335,18 @@ static int headers_parse(struct buffer *bu, struct headers_state *hs,
 		switch (hs->state) {
 		case 0: /* first char */
 			if (ch == '\r') {
-				if (name->cur)
-					env_set(env, name->data, value->data);
+				if (buffer_len(name))
+					env_set(env, buffer_data(name),
+						buffer_data(value));
 				hs->state = 6; /* CR/LF - end of headers */
 			} else if (ch == ' ' || ch == '\t') { /* indented continuation line */
 				// TODO: this is completely untested .. device a test for it!
 				// TODO: insert single SP for these leading LWS
 				hs->state = 4; /* append to existing value data */
 			} else {
-				if (name->cur)
-					env_set(env, name->data, value->data);
+				if (buffer_len(name))
+					env_set(env, buffer_data(name),
+						buffer_data(value));
 				buffer_reset(name);
 				buffer_reset(value);
 				buffer_addch(name, ch);
@@ -410,18 +413,18 @@ static int headers_parse(struct buffer *bu, struct headers_state *hs,
 		}
 	}
 
-	buffer_consume(bu, s - bu->data);
+	buffer_consume(bu, s - buffer_data(bu));
 	return 0;
 complete:
 	hs->done = true;
-	buffer_consume(bu, s - bu->data);
+	buffer_consume(bu, s - buffer_data(bu));
 	return 0;
 parse_error:
 	Error("%s():parse failure (%.*s)\n",
-		__func__, bu->cur, bu->data);
-	buffer_consume(bu, s - bu->data);
+		__func__, buffer_len(bu), buffer_data(bu));
+	buffer_consume(bu, s - buffer_data(bu));
 	Error("%s():parse failure @ %d (ch=%c state=%d)\n",
-		__func__, bu->cur, ch, hs->state);
+		__func__, buffer_len(bu), ch, hs->state);
 	return -1;
 }
 